@@ -0,0 +1,10 @@
+#barrier latency against the number of workers: times the master's apply
+#barrier sent to every worker directly and down a tree of FANOUT children
+FANOUT=4
+ROUNDS=200
+
+for WORKERS in 2 4 8 16 32 64 128 256
+do
+mpirun -n $((WORKERS + 1)) ./maiter --runner=Barrier --workers=$WORKERS --tree_fanout=$FANOUT --tree_min_workers=1 --barrier_rounds=$ROUNDS --v=0 > log.barrier$WORKERS 2>&1
+grep -h "latency_us" log.barrier$WORKERS
+done
@@ -0,0 +1,8 @@
+#load time of the partition files under input/: each file is parsed through
+#the getline and string read_data path and through the mapped file and
+#StringPiece read_data path
+for GRAPH in input/pagerank
+do
+mpirun -n 1 ./maiter --runner=PagerankLoad --graph_dir=$GRAPH --v=0 > log.load 2>&1
+grep -h "getline_s" log.load
+done
@@ -0,0 +1,21 @@
+#scaling of --kernel_threads: runs Pagerank with 1 to 32 threads per worker
+#and prints the runtime and busy update rate of each run
+ALGORITHM=Pagerank
+WORKERS=5
+GRAPH=input/pagerank
+RESULT=result/pagerank
+NODES=2000000
+SNAPSHOT=1
+TERMTHRESH=0.0001
+BUFMSG=64000
+BUFMSG2=50000
+DEGREE=10
+SHARD=4
+PORTION=1
+
+for THREADS in 1 2 4 8 16 32
+do
+./maiter  --runner=$ALGORITHM --workers=$WORKERS --graph_dir=$GRAPH --result_dir=$RESULT --num_nodes=$NODES --snapshot_interval=$SNAPSHOT --portion=$PORTION --termcheck_threshold=$TERMTHRESH --bufmsg=$BUFMSG --bufmsg2=$BUFMSG2 --degree=$DEGREE --shard=$SHARD --kernel_threads=$THREADS --v=0 > log.threads$THREADS 2>&1
+echo "threads $THREADS"
+grep -h "Total runtime\|updates/sec busy" log.threads$THREADS
+done
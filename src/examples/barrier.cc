@@ -0,0 +1,38 @@
+#include "client/client.h"
+
+using namespace dsm;
+
+DEFINE_int32(barrier_rounds, 200, "barriers the Barrier runner times of each kind");
+
+//times the master's apply barrier, sent to every worker directly and sent
+//down the --tree_fanout tree; prints the mean latency of each in microseconds
+static void TimeBarriers(bool tree) {
+    NetworkThread* net = NetworkThread::Get();
+    EmptyMessage empty;
+
+    //warm up the connections before timing
+    for (int i = 0; i < 10; ++i) {
+        net->SyncBroadcast(MTYPE_WORKER_APPLY, empty);
+    }
+
+    Timer t;
+    for (int i = 0; i < FLAGS_barrier_rounds; ++i) {
+        if (tree) {
+            net->SyncTreeBroadcast(MTYPE_WORKER_APPLY, empty);
+        } else {
+            net->SyncBroadcast(MTYPE_WORKER_APPLY, empty);
+        }
+    }
+    LOG(INFO) << "barrier " << (tree ? "tree" : "flat") << " workers " << net->size() - 1
+            << " latency_us " << t.elapsed() / FLAGS_barrier_rounds * 1e6;
+}
+
+static int Barrier(ConfigData& conf) {
+    if (!StartWorker(conf)) {
+        Master m(conf);
+        TimeBarriers(false);
+        TimeBarriers(true);
+    }
+    return 0;
+}
+REGISTER_RUNNER(Barrier);
@@ -53,11 +53,11 @@ struct PagerankIterateKernel : public IterateKernel<int, int, vector<int> > {
             pri = value-std::max(value,delta);
     }
 
-    void g_func(const int& k,const int& delta, const int& value, const vector<int>& data, vector<pair<int, int> >* output){
+    void g_func(const int& k,const int& delta, const int& value, const AdjacencySpan<int>& data, vector<pair<int, int> >* output){
             int outv = value;
             
             //cout << "size " << size << endl;
-            for(vector<int>::const_iterator it=data.begin(); it!=data.end(); it++){
+            for(AdjacencySpan<int>::const_iterator it=data.begin(); it!=data.end(); it++){
                     int target = *it;
                     output->push_back(make_pair(target, outv));
             }
@@ -0,0 +1,69 @@
+#include "util/common.h"
+#include "util/file.h"
+#include "kernel/partition-file.h"
+
+using namespace dsm;
+
+//converts the text partitions under --graph_dir, the part<N> files and the
+//part<N + shard> copy files, to binary partitions part<N>.csr, which
+//MaiterKernel1 maps instead of parsing with --binary_partitions. Keys and
+//neighbours are ints, in the "key\tneighbour neighbour ..." lines Pagerank
+//reads; a kernel whose read_data parses its lines otherwise cannot use them.
+//Rerun it after changing a part<N>: a part<N>.csr older than it is refused.
+
+DEFINE_string(graph_dir, "subgraphs", "directory of the part<N> files to convert");
+
+static void Convert(const string& path) {
+    Timer t;
+    MappedFile in(path);
+    vector<int> keys;
+    vector<int64_t> offsets(1, 0);
+    vector<int> edges;
+    int skipped = 0;
+
+    StringPiece line;
+    while (in.read_line(&line)) {
+        if (line.len == 0) continue;
+        const char* tab = (const char*) memchr(line.data, '\t', line.len);
+        StringPiece src(line.data, tab ? tab - line.data : 0);
+        int key;
+        if (!ConsumeInt(&src, &key)) {
+            ++skipped;
+            continue;
+        }
+        StringPiece links(tab + 1, line.data + line.len - tab - 1);
+        int to;
+        while (ConsumeInt(&links, &to)) {
+            edges.push_back(to);
+        }
+        keys.push_back(key);
+        offsets.push_back(edges.size());
+    }
+
+    string out = BinaryPartitionPath(path);
+    PartitionFile<int, int>::Write(out, keys, offsets, edges);
+    LOG(INFO) << "converted " << path << ": " << keys.size() << " nodes, " << edges.size() << " edges to " << out
+            << " in " << t.elapsed() << "s";
+    if (skipped > 0) {
+        LOG(WARNING) << "skipped " << skipped << " lines of " << path << " without a key";
+    }
+}
+
+int main(int argc, char** argv) {
+    FLAGS_logtostderr = true;
+    google::SetUsageMessage(StringPrintf("%s --graph_dir=<dir>: writes part<N>.csr next to each part<N>", argv[0]));
+    google::ParseCommandLineFlags(&argc, &argv, false);
+    google::InitGoogleLogging(argv[0]);
+
+    //only part<N> itself, not part<N>~ backups or files converted before
+    vector<string> files = File::MatchingFilenames(FLAGS_graph_dir + "/part*");
+    int converted = 0;
+    for (int i = 0; i < files.size(); ++i) {
+        string name = files[i].substr(files[i].rfind('/') + 1);
+        if (name.size() == 4 || name.find_first_not_of("0123456789", 4) != string::npos) continue;
+        Convert(files[i]);
+        ++converted;
+    }
+    CHECK_GT(converted, 0) << "no part<N> files in " << FLAGS_graph_dir;
+    return 0;
+}
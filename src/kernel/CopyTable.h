@@ -8,6 +8,7 @@
 #include "worker/worker.pb.h"
 #include "kernel/table.h"
 #include "kernel/local-table.h"
+#include "kernel/hash-index.h"
 #include <boost/noncopyable.hpp>
 #include <boost/random/mersenne_twister.hpp>
 #include <boost/random/uniform_int.hpp>
@@ -26,49 +27,22 @@ namespace dsm {
     public CTypedTable<K, V1>,
     private boost::noncopyable {
     private:
-#pragma pack(push, 1)
-
-        struct Bucket {
-            K k;
-            V1 v1;
-            vector<int> vec;
-            bool in_use;
-        };
-#pragma pack(pop)
-    private:
-
-        uint32_t bucket_idx(K k) {
-            return hashobj_(k) % size_;
-        }
 
         int bucket_for_key(const K& k) {
-            int start = bucket_idx(k);
-            int b = start;
-
-            do {
-                if (buckets_[b].in_use) {
-                    if (buckets_[b].k == k) {
-                        return b;
-                    }
-                } else {
-                    return -1;
-                }
-
-                b = (b + 1) % size_;
-            } while (b != start);
-
-            return -1;
+            return index_.find(k);
         }
 
-        std::vector<Bucket> buckets_;
+        //entries are kept packed in slots [0, entries_)
+        std::vector<K> keys_;
+        std::vector<V1> v1_;
+        std::vector<vector<int> > vec_;
+        HashIndex<K> index_;
 
         int64_t entries_;
         int64_t size_;
         double total_curr;
         int64_t total_updates;
 
-        std::tr1::hash<K> hashobj_;
-
     public:
 
         struct Iterator : public CTypedTableIterator<K, V1> {
@@ -88,32 +62,24 @@ namespace dsm {
             }
 
             bool Next() {
-                do {
-                    ++pos;
-                } while (pos < parent_.size_ && !parent_.buckets_[pos].in_use);
-
-                if (pos >= parent_.size_) {
-                    return false;
-                } else {
-                    return true;
-                }
-
+                ++pos;
+                return pos < parent_.entries_;
             }
 
             bool done() {
-                return pos + 1 == parent_.size_;
+                return pos + 1 >= parent_.entries_;
             }
 
             const K& key() {
-                return parent_.buckets_[pos].k;
+                return parent_.keys_[pos];
             }
 
             V1& value1() {
-                return parent_.buckets_[pos].v1;
+                return parent_.v1_[pos];
             }
 
             vector<int>& vec() {
-                return parent_.buckets_[pos].vec;
+                return parent_.vec_[pos];
             }
 
             int pos;
@@ -144,9 +110,7 @@ namespace dsm {
         }
 
         void clear() {
-            for (int i = 0; i < size_; ++i) {
-                buckets_[i].in_use = 0;
-            }
+            index_.clear(entries_ > 0 ? &keys_[0] : NULL, entries_);
             entries_ = 0;
         }
 
@@ -192,7 +156,7 @@ namespace dsm {
 
     template <class K, class V1>
     CopyTable<K, V1>::CopyTable(int size)
-    : buckets_(0), entries_(0), size_(0), total_curr(0), total_updates(0) {
+    : entries_(0), size_(0), total_curr(0), total_updates(0) {
         clear();
 
         VLOG(1) << "new CopyTable size " << size;
@@ -202,101 +166,86 @@ namespace dsm {
     template <class K, class V1>
     void CopyTable<K, V1>::resize(int64_t size) {
         CHECK_GT(size, 0);
-        if (size_ == size)
+        if (size <= size_)
             return;
 
-        std::vector<Bucket> old_b = buckets_;
-
-        buckets_.resize(size);
+        keys_.resize(size);
+        v1_.resize(size);
+        vec_.resize(size);
         size_ = size;
-        clear();
-
-        for (int i = 0; i < old_b.size(); ++i) {
-            if (old_b[i].in_use) {
-                put(old_b[i].k, old_b[i].v1, old_b[i].vec);
-            }
-        }
-
+        index_.reserve(size);
     }
 
     template<class K, class V1>
     bool CopyTable<K, V1>::contains(const K&k) {
-        int start = bucket_for_key(k);
-        if (start >= 0)
-            return true;
-        else
-            return false;
+        return bucket_for_key(k) != -1;
     }
 
     template<class K, class V1>
     V1 CopyTable<K, V1>::get(const K &k) {
         int b = bucket_for_key(k);
-        return buckets_[b].v1;
+        CHECK_NE(b, -1) << "No entry for requested key <" << *((int*) &k) << ">";
+        return v1_[b];
     }
 
     template<class K, class V1>
     vector<int> CopyTable<K, V1>::getV(const K &k) {
         int b = bucket_for_key(k);
-        return buckets_[b].vec;
+        CHECK_NE(b, -1) << "No entry for requested key <" << *((int*) &k) << ">";
+        return vec_[b];
     }
 
     template<class K, class V1>
     void CopyTable<K, V1>::put(const K &k, const V1 &v1, vector<int> &vec) {
-        int start = bucket_idx(k);
-        int b = start;
-        bool found = false;
-
-        do {
-            if (!buckets_[b].in_use) {
-                break;
-            }
-
-            if (buckets_[b].k == k) {
-                found = true;
-                break;
-            }
-
-            b = (b + 1) % size_;
-        } while (b != start);
+        int b = bucket_for_key(k);
 
         // Inserting a new entry:
-        if (!found) {
-            if (entries_ > size_ /** kLoadFactor*/) { //doesn't consider loadfactor, the tablesize is pre-defined 
-                //VLOG(0) << "resizing... " << size_ << " : " << (int)(1 + size_ * 2) << " entries "<< entries_;
-                //entries_-=1;
-                resize((int) (1 + size_ * 2));
-                put(k, v1, vec);
-                ++entries_;
-                //VLOG(0) << "if entries_: " << entries_<<"  key: "<<k;
-            } else {
-                buckets_[b].in_use = 1;
-                buckets_[b].k = k;
-                buckets_[b].v1 = v1;
-                buckets_[b].vec = vec;
-                ++entries_;
+        if (b == -1) {
+            if (entries_ == size_) {
+                resize(1 + size_ * 2);
             }
-        } else {
-            // Replacing an existing entry
-            buckets_[b].v1 = v1;
-            buckets_[b].vec = vec;
+            b = entries_++;
+            keys_[b] = k;
+            index_.insert(k, b);
         }
+
+        v1_[b] = v1;
+        vec_[b] = vec;
     }
 
     template<class K, class V1>
     void CopyTable<K, V1>::update(const K &k, const V1 &v) {
-        int start = bucket_for_key(k);
-        buckets_[start].v1 = v;
+        int b = bucket_for_key(k);
+        CHECK_NE(b, -1) << "No entry for requested key <" << *((int*) &k) << ">";
+        v1_[b] = v;
     }
 
+    //deltas for a vertex this worker holds no copy of are dropped
     template<class K, class V1>
     void CopyTable<K, V1>::accumulate(const K &k, const V1 &v) {
-        int start = bucket_for_key(k);
-        buckets_[start].v1 += v;
+        int b = bucket_for_key(k);
+        if (b == -1) {
+            LOG_FIRST_N(WARNING, 10) << "dropping delta for key <" << *((int*) &k) << ">, no copy of it in table " << id();
+            return;
+        }
+        v1_[b] += v;
     }
 
+    //the last entry moves into the freed slot to keep the entries packed
     template<class K, class V1>
     bool CopyTable<K, V1>::remove(const K &k) {
-
+        int b = index_.erase(k);
+        if (b == -1) return false;
+
+        int last = --entries_;
+        if (b != last) {
+            keys_[b] = keys_[last];
+            v1_[b] = v1_[last];
+            vec_[b].swap(vec_[last]);
+            index_.update(keys_[b], b);
+        }
+        vec_[last].clear();
+        return true;
     }
 
     template <class K, class V1>
@@ -0,0 +1,275 @@
+#ifndef ADJACENCY_H_
+#define ADJACENCY_H_
+
+#include "util/common.h"
+#include "util/file.h"
+#include <boost/shared_ptr.hpp>
+#include <algorithm>
+
+namespace dsm {
+
+    //A read-only view of one vertex's neighbours, pointing into an AdjacencyStore.
+    //Only valid until the next put into the owning table.
+
+    template <class T>
+    struct AdjacencySpan {
+        typedef const T* const_iterator;
+
+        AdjacencySpan() : begin_(NULL), end_(NULL) {
+        }
+
+        AdjacencySpan(const T* b, const T* e) : begin_(b), end_(e) {
+        }
+
+        const_iterator begin() const {
+            return begin_;
+        }
+
+        const_iterator end() const {
+            return end_;
+        }
+
+        size_t size() const {
+            return end_ - begin_;
+        }
+
+        bool empty() const {
+            return begin_ == end_;
+        }
+
+        const T& operator[](size_t i) const {
+            return begin_[i];
+        }
+
+        const T* begin_;
+        const T* end_;
+    };
+
+    //The neighbour lists of many nodes, in node order, for StateTable::bulk_build.
+    //Each store has its own Bulk type; add() appends one node's list.
+
+    template <class D>
+    struct AdjacencyList {
+        void add(const D& d) {
+            lists.push_back(d);
+        }
+
+        std::vector<D> lists;
+    };
+
+    //CSR form: node i's neighbours are edges [offset(i), offset(i + 1)). They
+    //are either built up with add() or, with use_mapped(), the edge and offset
+    //sections of a mapped file.
+
+    template <class T>
+    struct CsrAdjacency {
+        CsrAdjacency() : offsets(1, 0), mapped(NULL), mapped_offsets(NULL), mapped_edges(0) {
+        }
+
+        void add(const std::vector<T>& d) {
+            edges.insert(edges.end(), d.begin(), d.end());
+            offsets.push_back(edges.size());
+        }
+
+        //o holds nodes + 1 offsets into the edges at e, both inside f
+        void use_mapped(boost::shared_ptr<MappedFile> f, const T* e, const int64_t* o, int64_t nodes) {
+            file = f;
+            mapped = e;
+            mapped_offsets = o;
+            mapped_edges = o[nodes];
+        }
+
+        int64_t offset(int64_t i) const {
+            return mapped_offsets ? mapped_offsets[i] : offsets[i];
+        }
+
+        std::vector<int64_t> offsets;
+        std::vector<T> edges;
+        boost::shared_ptr<MappedFile> file;
+        const T* mapped;
+        const int64_t* mapped_offsets;
+        int64_t mapped_edges;
+    };
+
+    //Per-slot storage of the V3 (adjacency) field of a StateTable. The generic
+    //store keeps one D per slot; View is what IterateKernel::g_func receives and
+    //ViewRef what the table hands out for a slot. Held keeps a ViewRef for as
+    //long as the slots do not move, without copying the D.
+
+    template <class D>
+    class AdjacencyStore {
+    public:
+        typedef D View;
+        typedef const D& ViewRef;
+        typedef const D* Held;
+        typedef AdjacencyList<D> Bulk;
+
+        static Held hold(ViewRef v) {
+            return &v;
+        }
+
+        static ViewRef held(Held h) {
+            return *h;
+        }
+
+        void resize(int64_t slots) {
+            slots_.resize(slots);
+        }
+
+        void set(int64_t b, const D& d) {
+            slots_[b] = d;
+        }
+
+        //bulk loading: adopt() takes over a Bulk's lists and returns a base that
+        //set_bulk() then needs to give node i of it slot b
+        int64_t adopt(Bulk& bulk) {
+            return 0;
+        }
+
+        void set_bulk(int64_t b, const Bulk& bulk, int64_t i, int64_t base) {
+            slots_[b] = bulk.lists[i];
+        }
+
+        ViewRef view(int64_t b) const {
+            return slots_[b];
+        }
+
+        D get(int64_t b) const {
+            return slots_[b];
+        }
+
+    private:
+        std::vector<D> slots_;
+    };
+
+    //Neighbour lists are kept CSR-style: all edges of the shard live in one
+    //contiguous array and a slot only holds an offset and a length into it, so a
+    //vertex costs 12 bytes instead of a vector header plus its own heap block, and
+    //g_func streams its neighbours from one array. The array can also be the
+    //edge section of a mapped binary partition file, see adopt().
+
+    template <class T>
+    class AdjacencyStore<std::vector<T> > {
+    public:
+        typedef AdjacencySpan<T> View;
+        typedef AdjacencySpan<T> ViewRef;
+        typedef AdjacencySpan<T> Held;
+        typedef CsrAdjacency<T> Bulk;
+
+        static Held hold(ViewRef v) {
+            return v;
+        }
+
+        static ViewRef held(Held h) {
+            return h;
+        }
+
+        AdjacencyStore() : base_(NULL), mapped_edges_(0), dead_(0) {
+        }
+
+        void resize(int64_t slots) {
+            offset_.resize(slots);
+            length_.resize(slots);
+        }
+
+        //a list that fits in the slot's current extent is overwritten in place,
+        //anything longer is appended and the old extent is left unused. Once
+        //more than half of the array is unused it is compacted.
+        void set(int64_t b, const std::vector<T>& d) {
+            if (mapped_) unmap();
+            if (d.size() > length_[b]) {
+                dead_ += length_[b];
+                offset_[b] = edges_.size();
+                edges_.insert(edges_.end(), d.begin(), d.end());
+            } else {
+                dead_ += length_[b] - d.size();
+                std::copy(d.begin(), d.end(), edges_.begin() + offset_[b]);
+            }
+            length_[b] = d.size();
+            if (dead_ > kMinDead && dead_ * 2 > (int64_t) edges_.size()) compact();
+            base_ = edges_.empty() ? NULL : &edges_[0];
+        }
+
+        //the edges of bulk join the edge array and the returned base is where
+        //they start in it. Into an empty store they are swapped in, and mapped
+        //edges are used in place; the first set() after that copies them out,
+        //since the mapping is read-only.
+        int64_t adopt(Bulk& bulk) {
+            if (bulk.file) {
+                CHECK(edges_.empty() && !mapped_) << "mapping edges into a store that already has some";
+                mapped_ = bulk.file;
+                base_ = bulk.mapped;
+                mapped_edges_ = bulk.mapped_edges;
+                dead_ = 0;
+                return 0;
+            }
+            if (mapped_) unmap();
+            int64_t base = edges_.size();
+            if (edges_.empty()) {
+                dead_ = 0;
+                edges_.swap(bulk.edges);
+            } else {
+                edges_.insert(edges_.end(), bulk.edges.begin(), bulk.edges.end());
+            }
+            base_ = edges_.empty() ? NULL : &edges_[0];
+            return base;
+        }
+
+        void set_bulk(int64_t b, const Bulk& bulk, int64_t i, int64_t base) {
+            int64_t o = bulk.offset(i);
+            dead_ += length_[b];
+            offset_[b] = base + o;
+            length_[b] = bulk.offset(i + 1) - o;
+        }
+
+        ViewRef view(int64_t b) const {
+            if (length_[b] == 0) return View();
+            const T* p = base_ + offset_[b];
+            return View(p, p + length_[b]);
+        }
+
+        std::vector<T> get(int64_t b) const {
+            ViewRef v = view(b);
+            return std::vector<T>(v.begin(), v.end());
+        }
+
+        //edges held, including the unused extents not yet compacted away
+        int64_t stored_edges() const {
+            return mapped_ ? mapped_edges_ : edges_.size();
+        }
+
+    private:
+        static const int64_t kMinDead = 4096;
+
+        //copy every slot's extent into a fresh array, in slot order
+        void compact() {
+            std::vector<T> live;
+            live.reserve(edges_.size() - dead_);
+            for (size_t b = 0; b < offset_.size(); ++b) {
+                if (length_[b] == 0) continue;
+                int64_t o = live.size();
+                live.insert(live.end(), edges_.begin() + offset_[b], edges_.begin() + offset_[b] + length_[b]);
+                offset_[b] = o;
+            }
+            edges_.swap(live);
+            dead_ = 0;
+        }
+
+        void unmap() {
+            edges_.assign(base_, base_ + mapped_edges_);
+            mapped_.reset();
+            mapped_edges_ = 0;
+            base_ = edges_.empty() ? NULL : &edges_[0];
+        }
+
+        std::vector<int64_t> offset_;
+        std::vector<uint32_t> length_;
+        std::vector<T> edges_;
+        const T* base_; //&edges_[0], or the mapped edge array
+        boost::shared_ptr<MappedFile> mapped_;
+        int64_t mapped_edges_;
+        int64_t dead_; //edges no slot's extent covers any more
+    };
+}
+
+#endif /* ADJACENCY_H_ */
@@ -12,32 +12,28 @@
 #include "worker/worker.pb.h"
 #include "kernel/table.h"
 #include "kernel/local-table.h"
+#include "kernel/hash-index.h"
 #include <boost/noncopyable.hpp>
 
+DECLARE_bool(packed_updates);
+DECLARE_bool(sorted_updates);
+
 namespace dsm {
 
-    template <class K, class V1, class D>
+    //IK as in StateTable: the static type of the iterate kernel that merges
+    //buffered deltas
+    template <class K, class V1, class D, class IK = IterateKernel<K, V1, D> >
     class DeltaTable :
     public LocalTable,
     public PTypedTable<K, V1, D>,
     private boost::noncopyable {
-    private:
-#pragma pack(push, 1)
-
-        struct Bucket {
-            K k;
-            V1 v1;
-            bool in_use;
-        };
-#pragma pack(pop)
-
     public:
         typedef FileDecodeIterator<K, V1, int, int> FileUpdateDecoder;
         typedef NetDecodeIterator<K, V1> NetUpdateDecoder;
 
         struct Iterator : public PTypedTableIterator<K, V1> {
 
-            Iterator(DeltaTable<K, V1, D>& parent) : pos(-1), parent_(parent) {
+            Iterator(DeltaTable<K, V1, D, IK>& parent) : pos(-1), parent_(parent) {
                 Next();
             }
 
@@ -53,38 +49,30 @@ namespace dsm {
             }
 
             bool Next() {
-                do {
-                    ++pos;
-                } while (pos < parent_.size_ && !parent_.buckets_[pos].in_use);
-
-                if (pos >= parent_.size_) {
-                    return false;
-                } else {
-                    return true;
-                }
-
+                ++pos;
+                return pos < parent_.entries_;
             }
 
             bool done() {
-                return pos == parent_.size_;
+                return pos >= parent_.entries_;
             }
 
             const K& key() {
-                return parent_.buckets_[pos].k;
+                return parent_.keys_[pos];
             }
 
             V1& value1() {
-                return parent_.buckets_[pos].v1;
+                return parent_.v1_[pos];
             }
 
             int pos;
-            DeltaTable<K, V1, D> &parent_;
+            DeltaTable<K, V1, D, IK> &parent_;
         };
 
         struct Factory : public TableFactory {
 
             TableBase* New() {
-                return new DeltaTable<K, V1, D>();
+                return new DeltaTable<K, V1, D, IK>();
             }
         };
 
@@ -104,10 +92,7 @@ namespace dsm {
         void update(const K& k, const V1& v);
         void accumulate(const K& k, const V1& v);
 
-        bool remove(const K& k) {
-            LOG(FATAL) << "Not implemented.";
-            return false;
-        }
+        bool remove(const K& k);
 
         void resize(int64_t size);
 
@@ -120,17 +105,13 @@ namespace dsm {
         }
 
         void clear() {
-            for (int i = 0; i < size_; ++i) {
-                buckets_[i].in_use = 0;
-            }
+            index_.clear(entries_ > 0 ? &keys_[0] : NULL, entries_);
             entries_ = 0;
         }
 
+        //called after every send, keep the capacity for the next batch
         void reset() {
-            buckets_.clear();
-            size_ = 0;
-            entries_ = 0;
-            resize(1);
+            clear();
         }
 
         TableIterator *get_iterator(TableHelper* helper, bool bfilter) {
@@ -164,47 +145,60 @@ namespace dsm {
 
     private:
 
-        uint32_t bucket_idx(K k) {
-            return hashobj_(k) % size_;
+        int bucket_for_key(const K& k) {
+            return index_.find(k);
         }
 
-        int bucket_for_key(const K& k) {
-            int start = bucket_idx(k);
-            int b = start;
-
-            do {
-                if (buckets_[b].in_use) {
-                    if (buckets_[b].k == k) {
-                        return b;
-                    }
-                } else {
-                    return -1;
-                }
+        struct KeyOrder {
+            const K* keys;
 
-                b = (b + 1) % size_;
-            } while (b != start);
+            bool operator()(int a, int b) const {
+                return keys[a] < keys[b];
+            }
+        };
 
-            return -1;
+        //sorts the entries by key into packed_keys_ (as GapKeys) and sorted_v1_
+        void encode_sorted() {
+            order_.resize(entries_);
+            for (int i = 0; i < entries_; ++i) {
+                order_[i] = i;
+            }
+            KeyOrder less = {&keys_[0]};
+            std::sort(order_.begin(), order_.end(), less);
+
+            packed_keys_.clear();
+            GapKeys<K>::encode(&keys_[0], &order_[0], entries_, &packed_keys_);
+            sorted_v1_.resize(entries_);
+            for (int i = 0; i < entries_; ++i) {
+                sorted_v1_[i] = v1_[order_[i]];
+            }
         }
 
-        std::vector<Bucket> buckets_;
+        //entries are kept packed in slots [0, entries_), so a send walks
+        //exactly the buffered deltas
+        std::vector<K> keys_;
+        std::vector<V1> v1_;
+        HashIndex<K> index_;
+
+        //serializeToNet scratch for --sorted_updates
+        std::vector<int> order_;
+        string packed_keys_;
+        std::vector<V1> sorted_v1_;
 
         int64_t entries_;
         int64_t size_;
-
-        std::tr1::hash<K> hashobj_;
     };
 
-    template <class K, class V1, class D>
-    DeltaTable<K, V1, D>::DeltaTable(int size)
-    : buckets_(0), entries_(0), size_(0) {
+    template <class K, class V1, class D, class IK>
+    DeltaTable<K, V1, D, IK>::DeltaTable(int size)
+    : entries_(0), size_(0) {
         clear();
 
         resize(size);
     }
 
-    template <class K, class V1, class D>
-    void DeltaTable<K, V1, D>::serializeToFile(TableCoder *out) {
+    template <class K, class V1, class D, class IK>
+    void DeltaTable<K, V1, D, IK>::serializeToFile(TableCoder *out) {
         Iterator *i = (Iterator*) get_iterator(NULL, false);
         string k, v1;
         while (!i->done()) {
@@ -218,8 +212,22 @@ namespace dsm {
         delete i;
     }
 
-    template <class K, class V1, class D>
-    void DeltaTable<K, V1, D>::serializeToNet(KVPairCoder *out) {
+    template <class K, class V1, class D, class IK>
+    void DeltaTable<K, V1, D, IK>::serializeToNet(KVPairCoder *out) {
+        //the live entries already sit in [0, entries_) of keys_ and v1_
+        if (FLAGS_packed_updates && PackedEntries<K, V1>::supported && entries_ > 0) {
+            if (FLAGS_sorted_updates && PackedEntries<K, V1>::gap_keys) {
+                encode_sorted();
+                if (out->WritePackedToNet(packed_keys_,
+                        StringPiece((const char*) &sorted_v1_[0], entries_ * sizeof (V1)), true)) {
+                    return;
+                }
+            } else if (out->WritePackedToNet(StringPiece((const char*) &keys_[0], entries_ * sizeof (K)),
+                    StringPiece((const char*) &v1_[0], entries_ * sizeof (V1)), false)) {
+                return;
+            }
+        }
+
         Iterator *i = (Iterator*) get_iterator(NULL, false);
         string k, v1;
         while (!i->done()) {
@@ -234,8 +242,8 @@ namespace dsm {
         delete i;
     }
 
-    template <class K, class V1, class D>
-    void DeltaTable<K, V1, D>::deserializeFromFile(TableCoder *in, DecodeIteratorBase *itbase) {
+    template <class K, class V1, class D, class IK>
+    void DeltaTable<K, V1, D, IK>::deserializeFromFile(TableCoder *in, DecodeIteratorBase *itbase) {
         FileUpdateDecoder* it = static_cast<FileUpdateDecoder*> (itbase);
         K k;
         V1 v1;
@@ -251,8 +259,8 @@ namespace dsm {
         return;
     }
 
-    template <class K, class V1, class D>
-    void DeltaTable<K, V1, D>::deserializeFromNet(KVPairCoder *in, DecodeIteratorBase *itbase) {
+    template <class K, class V1, class D, class IK>
+    void DeltaTable<K, V1, D, IK>::deserializeFromNet(KVPairCoder *in, DecodeIteratorBase *itbase) {
         NetUpdateDecoder* it = static_cast<NetUpdateDecoder*> (itbase);
         K k;
         V1 v1;
@@ -268,100 +276,84 @@ namespace dsm {
         return;
     }
 
-    template <class K, class V1, class D>
-    void DeltaTable<K, V1, D>::resize(int64_t size) {
+    template <class K, class V1, class D, class IK>
+    void DeltaTable<K, V1, D, IK>::resize(int64_t size) {
         CHECK_GT(size, 0);
-        if (size_ == size)
+        if (size <= size_)
             return;
 
-        std::vector<Bucket> old_b = buckets_;
-        int old_entries = entries_;
-
-        //VLOG(2) << "Rehashing... " << entries_ << " : " << size_ << " -> " << size;
-
-        buckets_.resize(size);
+        keys_.resize(size);
+        v1_.resize(size);
         size_ = size;
-        clear();
-
-        for (int i = 0; i < old_b.size(); ++i) {
-            if (old_b[i].in_use) {
-                put(old_b[i].k, old_b[i].v1);
-            }
-        }
-
-        CHECK_EQ(old_entries, entries_);
+        index_.reserve(size);
     }
 
-    template <class K, class V1, class D>
-    bool DeltaTable<K, V1, D>::contains(const K& k) {
+    template <class K, class V1, class D, class IK>
+    bool DeltaTable<K, V1, D, IK>::contains(const K& k) {
         return bucket_for_key(k) != -1;
     }
 
-    template <class K, class V1, class D>
-    V1 DeltaTable<K, V1, D>::get(const K& k) {
+    template <class K, class V1, class D, class IK>
+    V1 DeltaTable<K, V1, D, IK>::get(const K& k) {
         int b = bucket_for_key(k);
         //The following key display is a hack hack hack and only yields valid
         //results for ints.  It will display nonsense for other types.
         CHECK_NE(b, -1) << "No entry for requested key <" << *((int*) &k) << ">";
 
-        return buckets_[b].v1;
+        return v1_[b];
     }
 
-    template <class K, class V1, class D>
-    void DeltaTable<K, V1, D>::update(const K& k, const V1& v) {
+    template <class K, class V1, class D, class IK>
+    void DeltaTable<K, V1, D, IK>::update(const K& k, const V1& v) {
         int b = bucket_for_key(k);
 
         CHECK_NE(b, -1) << "No entry for requested key <" << *((int*) &k) << ">";
 
-        buckets_[b].v1 = v;
+        v1_[b] = v;
     }
 
-    template <class K, class V1, class D>
-    void DeltaTable<K, V1, D>::accumulate(const K& k, const V1& v) {
+    template <class K, class V1, class D, class IK>
+    void DeltaTable<K, V1, D, IK>::accumulate(const K& k, const V1& v) {
         int b = bucket_for_key(k);
         if (b == -1) {
             put(k, v);
         } else {
-            //((IterateKernel<K, V1, D>*)info_.iterkernel)->accumulate(&buckets_[b].v1, v);
-            ((IterateKernel<K, V1, D>*)info_.iterkernel)->accumulate(buckets_[b].v1, v);
+            //((IterateKernel<K, V1, D>*)info_.iterkernel)->accumulate(&v1_[b], v);
+            KernelCalls<IK>::accumulate((IK*) info_.iterkernel, v1_[b], v);
         }
     }
 
-    template <class K, class V1, class D>
-    void DeltaTable<K, V1, D>::put(const K& k, const V1& v1) {
-        int start = bucket_idx(k);
-        int b = start;
-        bool found = false;
+    template <class K, class V1, class D, class IK>
+    void DeltaTable<K, V1, D, IK>::put(const K& k, const V1& v1) {
+        int b = bucket_for_key(k);
 
         //VLOG(2) << "put " << k << "," << v1 << " into deltatable";
-        do {
-            if (!buckets_[b].in_use) {
-                break;
+        if (b == -1) {
+            // Inserting a new entry:
+            if (entries_ == size_) {
+                resize(1 + size_ * 2);
             }
+            b = entries_++;
+            keys_[b] = k;
+            index_.insert(k, b);
+        }
 
-            if (buckets_[b].k == k) {
-                found = true;
-                break;
-            }
+        v1_[b] = v1;
+    }
 
-            b = (b + 1) % size_;
-        } while (b != start);
-
-        // Inserting a new entry:
-        if (!found) {
-            if (entries_ > size_ * kLoadFactor) {
-                resize((int) (1 + size_ * 2));
-                put(k, v1);
-            } else {
-                buckets_[b].in_use = 1;
-                buckets_[b].k = k;
-                buckets_[b].v1 = v1;
-                ++entries_;
-            }
-        } else {
-            // Replacing an existing entry
-            buckets_[b].v1 = v1;
+    //the last entry moves into the freed slot to keep the entries packed
+    template <class K, class V1, class D, class IK>
+    bool DeltaTable<K, V1, D, IK>::remove(const K& k) {
+        int b = index_.erase(k);
+        if (b == -1) return false;
+
+        int last = --entries_;
+        if (b != last) {
+            keys_[b] = keys_[last];
+            v1_[b] = v1_[last];
+            index_.update(keys_[b], b);
         }
+        return true;
     }
 }
 
@@ -1,11 +1,19 @@
 #include "kernel/global-table.h"
 #include "statetable.h"
 
-static const int kMaxNetworkPending = 1 << 26;
-static const int kMaxNetworkChunk = 1 << 20;
-
 DEFINE_int32(snapshot_interval, 99999999, "");
+DEFINE_bool(dense_table, false, "index state tables of int keys sharded by Sharding::Mod with key / num_shards instead of hashing; memory grows with the largest key");
+DEFINE_int32(kernel_threads, 1, "threads that share each pass over a worker's state table");
+DEFINE_string(webgraph, "", "base path (no .graph.gz) of a BV-compressed WebGraph each worker streams its own nodes from, instead of reading --graph_dir");
+DEFINE_bool(binary_partitions, false, "load the part<N>.csr files csrconv writes instead of parsing part<N> with the kernel's read_data");
+DEFINE_int32(load_threads, 1, "threads that parse a worker's text partition; above 1 the kernel's read_data, init_v and init_c run concurrently");
+DEFINE_bool(packed_updates, true, "send deltas of fixed-width keys and values as packed arrays instead of one Arg per entry");
+DEFINE_bool(sorted_updates, false, "sort packed deltas of integral keys by key and send the keys as varint gaps");
+DEFINE_bool(compress_updates, false, "LZO-compress packed update batches");
 //DEFINE_int32(bufmsg, 1000000, "");
+DEFINE_int32(bufmsg_min, 100, "smallest number of buffered writes a remote shard's updates are sent at");
+DEFINE_double(flush_max_age, 0.02, "seconds updates for a remote shard may stay buffered");
+DEFINE_int64(flush_backlog, 1 << 20, "unsent bytes in the network thread above which send thresholds grow");
 
 namespace dsm {
 
@@ -193,6 +201,55 @@ namespace dsm {
         a->set_value(v.data, v.len);
     }
 
+    //per-thread LZO compressor state: its work memory and the block to compress
+    struct LZOScratch {
+        char work[LZO1X_1_15_MEM_COMPRESS];
+        string raw;
+    };
+    static boost::thread_specific_ptr<LZOScratch> lzo_scratch;
+
+    bool ProtoKVPairCoder::WritePackedToNet(StringPiece keys, StringPiece values, bool gap_keys) {
+        if (gap_keys) {
+            t_->set_gap_keys(true);
+        }
+
+        string* data = t_->mutable_table_data();
+        if (!FLAGS_compress_updates) {
+            data->reserve(keys.len + values.len);
+            data->assign(keys.data, keys.len);
+            data->append(values.data, values.len);
+            return true;
+        }
+
+        if (lzo_scratch.get() == NULL) {
+            lzo_scratch.reset(new LZOScratch);
+        }
+        string& raw = lzo_scratch->raw;
+        raw.assign(keys.data, keys.len);
+        raw.append(values.data, values.len);
+
+        lzo_uint len = raw.size() + raw.size() / 16 + 64 + 3;
+        data->resize(len);
+        CHECK_EQ(0, lzo1x_1_15_compress((unsigned char*) raw.data(), raw.size(),
+                (unsigned char*) &(*data)[0], &len, (unsigned char*) lzo_scratch->work));
+        data->resize(len);
+        t_->set_raw_size(raw.size());
+        return true;
+    }
+
+    const string& PackedUpdateData(const KVPairData& req, string* scratch) {
+        if (!req.has_raw_size()) {
+            return req.table_data();
+        }
+
+        scratch->resize(req.raw_size());
+        lzo_uint len = req.raw_size();
+        CHECK_EQ(0, lzo1x_decompress_safe((unsigned char*) req.table_data().data(), req.table_data().size(),
+                (unsigned char*) &(*scratch)[0], &len, NULL)) << "corrupt packed update from " << req.source();
+        CHECK_EQ(len, req.raw_size());
+        return *scratch;
+    }
+
     void MutableGlobalTableBase::BufSend() {
         if (pending_writes_ > FLAGS_bufmsg) {
             VLOG(2) << "accumulate enought pending writes " << pending_writes_ << " we send them";
@@ -201,32 +258,9 @@ namespace dsm {
     }
 
     void MutableGlobalTableBase::SendUpdates() {
-        KVPairData put;
         for (int i = 0; i < partitions_.size(); ++i) {
-            LocalTable *t = partitions_[i];
-
-            if (!is_local_shard(i) && (get_partition_info(i)->dirty || !t->empty())) {
-                // Always send at least one chunk, to ensure that we clear taint on
-                // tables we own.
-                do {
-                    put.Clear();
-                    put.set_shard(i);
-                    put.set_source(helper()->id());
-                    put.set_table(id());
-                    put.set_epoch(helper()->epoch());
-
-                    ProtoKVPairCoder c(&put);
-                    t->serializeToNet(&c);
-                    t->reset();
-                    put.set_done(true);
-
-                    //VLOG(3) << "Sending update for " << MP(t->id(), t->shard()) << " to " << owner(i) << " size " << put.kv_data_size();
-                    //        cout<< "Sending update for " << MP(t->id(), t->shard()) << " to " << owner(i) << " size " << put.kv_data_size()<<endl;
-                    sent_bytes_ += NetworkThread::Get()->Send(owner(i) + 1, MTYPE_PUT_REQUEST, put);
-                } while (!t->empty());
-
-                //VLOG(3) << "Done with update for " << MP(t->id(), t->shard());
-                t->clear();
+            if (!is_local_shard(i) && (get_partition_info(i)->dirty || !partitions_[i]->empty())) {
+                send_shard(i);
             }
         }
 
@@ -242,12 +276,123 @@ namespace dsm {
         pending_writes_ = 0;
     }
 
+    void MutableGlobalTableBase::SendReadyUpdates() {
+        for (int i = 0; i < partitions_.size(); ++i) {
+            if (is_local_shard(i)) {
+                continue;
+            }
+            if (get_partition_info(i)->dirty || (!partitions_[i]->empty() && has_credit(i))) {
+                send_shard(i);
+            }
+        }
+    }
+
+    void MutableGlobalTableBase::FlushStale() {
+        if (shard_writes_.empty() || pending_writes_ == 0) {
+            return;
+        }
+
+        double now = Now();
+        for (int i = 0; i < partitions_.size(); ++i) {
+            if (shard_writes_[i] > 0 && now - shard_first_write_[i] > FLAGS_flush_max_age && has_credit(i)) {
+                // the buffer filled slower than its threshold: send smaller
+                // batches from now on so sparse deltas do not wait.
+                flush_threshold_[i] = max<int64_t>(flush_threshold_[i] / 2, FLAGS_bufmsg_min);
+                __sync_fetch_and_add(&flush_age_, 1);
+                send_shard(i);
+            }
+        }
+    }
+
+    void MutableGlobalTableBase::init_flush_policy() {
+        // start from the batch each remote shard got on average when one
+        // counter over all of them was compared with --bufmsg.
+        flush_start_ = max<int64_t>(FLAGS_bufmsg / max(num_shards() - 1, 1), FLAGS_bufmsg_min);
+        shard_writes_.assign(partitions_.size(), 0);
+        shard_first_write_.assign(partitions_.size(), 0);
+        flush_threshold_.assign(partitions_.size(), flush_start_);
+    }
+
+    void MutableGlobalTableBase::flush_full(int shard) {
+        if (!has_credit(shard)) {
+            if (shard_writes_[shard] == flush_threshold_[shard] + 1) {
+                __sync_fetch_and_add(&credit_stalls_, 1);
+            }
+            return;
+        }
+
+        // a send backlog means the network, not the batch size, is the limit:
+        // larger batches cost fewer messages for the same updates.  Without
+        // one, a threshold cut down for sparse deltas grows back to the start.
+        int64_t& threshold = flush_threshold_[shard];
+        if (NetworkThread::Get()->pending_bytes() > FLAGS_flush_backlog) {
+            threshold = min<int64_t>(threshold * 2, max<int64_t>(FLAGS_bufmsg, flush_start_));
+        } else if (threshold < flush_start_) {
+            threshold = min(threshold * 2, flush_start_);
+        }
+        __sync_fetch_and_add(&flush_full_, 1);
+        send_shard(shard);
+    }
+
+    // Sends the updates buffered for shard 'shard' in one message together
+    // with those of every other remote shard its owner holds.
+    void MutableGlobalTableBase::send_shard(int shard) {
+        KVPairData put;
+        int dst = owner(shard);
+        int64_t entries = write_shard(shard, &put);
+        for (int i = 0; i < partitions_.size(); ++i) {
+            if (i != shard && !is_local_shard(i) && owner(i) == dst
+                    && (get_partition_info(i)->dirty || !partitions_[i]->empty())) {
+                entries += write_shard(i, &put);
+            }
+        }
+
+        //VLOG(3) << "Sending update for " << MP(id(), shard) << " to " << dst << " size " << put.ByteSize();
+        int bytes = NetworkThread::Get()->Send(dst + 1, MTYPE_PUT_REQUEST, put);
+        sent_bytes_ += bytes;
+        __sync_fetch_and_add(&entries_sent_, entries);
+        __sync_fetch_and_add(&bytes_sent_, (int64_t) bytes);
+        __sync_fetch_and_add(&shards_bundled_, (int64_t) put.bundled_size());
+    }
+
+    // Moves what is buffered for shard i into 'put': into the message itself
+    // if it is still empty, else into a bundled part.
+    int64_t MutableGlobalTableBase::write_shard(int i, KVPairData* put) {
+        LocalTable *t = partitions_[i];
+        int64_t entries = 0;
+
+        // Always send at least one chunk, to ensure that we clear taint on
+        // tables we own.
+        do {
+            KVPairData* part = put->has_shard() ? put->add_bundled() : put;
+            part->set_shard(i);
+            part->set_source(helper()->id());
+            part->set_table(id());
+            part->set_epoch(helper()->epoch());
+
+            ProtoKVPairCoder c(part);
+            entries += t->size();
+            t->serializeToNet(&c);
+            t->reset();
+            part->set_done(true);
+        } while (!t->empty());
+
+        t->clear();
+
+        if (!shard_writes_.empty()) {
+            pending_writes_ -= shard_writes_[i];
+            shard_writes_[i] = 0;
+        }
+        return entries;
+    }
+
     void MutableGlobalTableBase::SendUpdates2() {
         KVPairData put;
         for (int i = 0; i < cpartitions_.size(); ++i) {
             LocalTable *t = cpartitions_[i];
 
             if (!is_local_shard(i) && (get_partition_info(i)->dirty || !t->empty())) {
+                __sync_fetch_and_add(&entries_sent_, (int64_t) t->size());
                 // Always send at least one chunk, to ensure that we clear taint on
                 // tables we own.
                 do {
@@ -264,7 +409,9 @@ namespace dsm {
 
                     //VLOG(3) << "Sending update for " << MP(t->id(), t->shard()) << " to " << owner(i) << " size " << put.kv_data_size();
                     //        cout<< "Sending update for " << MP(t->id(), t->shard()) << " to " << owner(i) << " size " << put.kv_data_size()<<endl;
-                    sent_bytes_ += NetworkThread::Get()->Send(owner(i) + 1, MTYPE_PUT_REQUEST, put);
+                    int bytes = NetworkThread::Get()->Send(owner(i) + 1, MTYPE_PUT_REQUEST, put);
+                    sent_bytes_ += bytes;
+                    __sync_fetch_and_add(&bytes_sent_, (int64_t) bytes);
                 } while (!t->empty());
 
                 //VLOG(3) << "Done with update for " << MP(t->id(), t->shard());
@@ -296,6 +443,19 @@ namespace dsm {
         return s;
     }
 
+    void MutableGlobalTableBase::TableStats(Stats* out) {
+        const char* names[] = { "update_flush_age", "update_credit_stalls", "update_flush_full",
+            "update_entries_sent", "update_bytes_sent", "update_shards_bundled" };
+        int64_t* counts[] = { &flush_age_, &credit_stalls_, &flush_full_,
+            &entries_sent_, &bytes_sent_, &shards_bundled_ };
+        for (int i = 0; i < 6; ++i) {
+            int64_t n = __sync_fetch_and_add(counts[i], 0);
+            if (n > 0) {
+                (*out)[names[i]] += n;
+            }
+        }
+    }
+
     void MutableGlobalTableBase::local_swap(GlobalTable *b) {
         CHECK(this != b);
 
@@ -304,5 +464,8 @@ namespace dsm {
         std::swap(partitions_, mb->partitions_);
         std::swap(cache_, mb->cache_);
         std::swap(pending_writes_, mb->pending_writes_);
+        std::swap(shard_writes_, mb->shard_writes_);
+        std::swap(shard_first_write_, mb->shard_first_write_);
+        std::swap(flush_threshold_, mb->flush_threshold_);
     }
 }
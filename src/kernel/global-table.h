@@ -13,6 +13,9 @@
 
 DECLARE_int32(bufmsg);
 DECLARE_int32(bufmsg2);
+DECLARE_int32(bufmsg_min);
+DECLARE_double(flush_max_age);
+DECLARE_int64(flush_backlog);
 
 namespace dsm {
 
@@ -36,11 +39,16 @@ namespace dsm {
         ProtoKVPairCoder(const KVPairData* in);
         virtual void WriteEntryToNet(StringPiece k, StringPiece v1);
         virtual bool ReadEntryFromNet(string* k, string *v1);
+        virtual bool WritePackedToNet(StringPiece keys, StringPiece values, bool gap_keys);
 
         int read_pos_;
         KVPairData *t_;
     };
 
+    //the table_data of a packed update, uncompressed into scratch if it was
+    //sent with --compress_updates
+    const string& PackedUpdateData(const KVPairData& req, string* scratch);
+
     struct PartitionInfo {
 
         PartitionInfo() : dirty(false), tainted(false) {
@@ -75,12 +83,17 @@ namespace dsm {
     public:
         // Handle updates from the master or other workers.
         virtual void SendUpdates() = 0;
+        // Like SendUpdates, but leaves the updates for workers that are out
+        // of put credit buffered.
+        virtual void SendReadyUpdates() = 0;
         virtual void SendUpdates2() = 0;
         virtual void ApplyUpdates(const KVPairData& req) = 0;
         virtual void HandlePutRequests() = 0;
         virtual void TermCheck() = 0;
 
         virtual int pending_write_bytes() = 0;
+        // Adds the counts of this table's update sends to 'out'.
+        virtual void TableStats(Stats* out) = 0;
 
         virtual void clear() = 0;
         virtual void resize(int64_t new_size) = 0;
@@ -163,16 +176,23 @@ namespace dsm {
             snapshot_index = 0;
             sent_bytes_ = 0;
             sendtime = 0;
+            flush_age_ = credit_stalls_ = flush_full_ = 0;
+            entries_sent_ = bytes_sent_ = shards_bundled_ = 0;
         }
 
         void BufSend();
         void SendUpdates();
+        void SendReadyUpdates();
+        // Sends the updates buffered for the remote shards that have waited
+        // longer than --flush_max_age.
+        void FlushStale();
         void SendUpdates2();
         virtual void ApplyUpdates(const KVPairData& req) = 0;
         void HandlePutRequests();
         void TermCheck();
 
         int pending_write_bytes();
+        void TableStats(Stats* out);
 
         void clear();
         void resize(int64_t new_size);
@@ -195,6 +215,59 @@ namespace dsm {
         void local_swap(GlobalTable *b);
         void termcheck();
 
+        // Counts an update buffered for remote shard 'shard' and sends that
+        // shard's buffer once it holds flush_threshold_[shard] writes.  Every
+        // kAgeCheckWrites writes the other buffers are checked for age.
+        void buffered_remote_write(int shard, int64_t writes = 1) {
+            if (flush_threshold_.empty()) {
+                init_flush_policy();
+            }
+
+            int64_t before = pending_writes_;
+            pending_writes_ += writes;
+            if (shard_writes_[shard] == 0) {
+                shard_first_write_[shard] = Now();
+            }
+            shard_writes_[shard] += writes;
+            if (shard_writes_[shard] > flush_threshold_[shard]) {
+                flush_full(shard);
+            } else if (before / kAgeCheckWrites != pending_writes_ / kAgeCheckWrites) {
+                FlushStale();
+            }
+        }
+
+    private:
+        static const int kAgeCheckWrites = 256;
+
+        void init_flush_policy();
+        void flush_full(int shard);
+        void send_shard(int shard);
+        int64_t write_shard(int shard, KVPairData* put);
+        // False while the owner of 'shard' has too many of our put requests
+        // unread; the shard's updates then keep combining in its buffer.
+        bool has_credit(int shard) {
+            return NetworkThread::Get()->HasCredit(owner(shard) + 1);
+        }
+
+        // Per remote shard: writes buffered since its last send, when the
+        // first of them came in, and how many it may hold before it is sent.
+        // The threshold starts at flush_start_, doubles while the network
+        // thread has a send backlog and halves when a buffer is sent for age
+        // rather than size.
+        int64_t flush_start_;
+        vector<int64_t> shard_writes_;
+        vector<double> shard_first_write_;
+        vector<int64_t> flush_threshold_;
+
+        // Counts of the sends above, bumped atomically by the threads that
+        // send and read by TableStats.
+        int64_t flush_age_;
+        int64_t credit_stalls_;
+        int64_t flush_full_;
+        int64_t entries_sent_;
+        int64_t bytes_sent_;
+        int64_t shards_bundled_;
+
 
         //double send_overhead;
         //double objectcreate_overhead;
@@ -265,12 +338,15 @@ namespace dsm {
         void setCopy(const K&k);
         void setNoCopy(const K&k);
         void updateF1(const K &k, const V1 &v);
+        V1 takeF1(const K &k, const V1 &v);
         void updateF2(const K &k, const V2 &v);
         void updateF3(const K &k, const V3 &v);
         void enqueue_updateF1(K k, V1 v);
         void accumulateFFF(const K &k, const V1 &v, int shard);
         void accumulateFF(const K &k, const V1 &v, int shard);
         void accumulateF1(const K &k, const V1 &v); // 2 TypeGloobleTable :TypeTable
+        void accumulateF1Batch(const pair<K, V1>* begin, const pair<K, V1>* end);
+        void accumulateRemote(vector<pair<K, V1> >* updates);
         void accumulateF2(const K &k, const V2 &v);
         void accumulateF3(const K &k, const V3 &v);
 
@@ -313,9 +389,19 @@ namespace dsm {
             return (TypedTableIterator<K, V1, V2, V3>*) partitions_[shard]->entirepass_iterator(this->helper());
         }
 
+        //applies a put request and the shards bundled with it under one lock
         void ApplyUpdates(const dsm::KVPairData& req) {
             boost::recursive_mutex::scoped_lock sl(mutex());
 
+            ApplyShardUpdates(req);
+            for (int i = 0; i < req.bundled_size(); ++i) {
+                ApplyShardUpdates(req.bundled(i));
+            }
+
+            TermCheck();
+        }
+
+        void ApplyShardUpdates(const dsm::KVPairData& req) {
             //VLOG(2) << "applying updates, from " << req.source();
 
             if (!is_local_shard(req.shard())) {
@@ -324,6 +410,11 @@ namespace dsm {
                         << " to " << owner(req.shard());
             }
 
+            if (req.has_table_data()) {
+                ApplyPackedUpdates(req);
+                return;
+            }
+
             // Changes to support centralized of triggers <CRM>
             ProtoKVPairCoder c(&req);
 
@@ -340,9 +431,47 @@ namespace dsm {
                     accumulateFFF(it.key(), it.value1(), shard);
                 }
             }
+        }
 
-
-            TermCheck();
+        //applies a table_data payload written by WritePackedToNet straight
+        //from the message buffer
+        void ApplyPackedUpdates(const dsm::KVPairData& req) {
+            CHECK((PackedEntries<K, V1>::supported)) << "packed updates for a table with variable-width entries";
+            const string& data = PackedUpdateData(req, &packed_raw_);
+            int n;
+            const char* keys = data.data();
+            const char* values;
+            if (req.gap_keys()) {
+                int len = GapKeys<K>::decode(data.data(), data.size(), &packed_keys_);
+                CHECK_GE(len, 0) << "malformed packed update from " << req.source();
+                n = packed_keys_.size();
+                keys = n > 0 ? (const char*) &packed_keys_[0] : NULL;
+                values = data.data() + len;
+                CHECK_EQ(len + n * sizeof (V1), data.size()) << "malformed packed update from " << req.source();
+            } else {
+                n = data.size() / (sizeof (K) + sizeof (V1));
+                CHECK_EQ(n * (sizeof (K) + sizeof (V1)), data.size()) << "malformed packed update from " << req.source();
+                values = keys + n * sizeof (K);
+            }
+            if (n == 0) return;
+
+            K k;
+            V1 v1;
+            memcpy(&k, keys, sizeof (K));
+            if (is_local_shard(get_shard(k))) {
+                for (int i = 0; i < n; ++i) {
+                    memcpy(&k, keys + i * sizeof (K), sizeof (K));
+                    memcpy(&v1, values + i * sizeof (V1), sizeof (V1));
+                    accumulateF1(k, v1);
+                }
+            } else {
+                int shard = req.shard();
+                for (int i = 0; i < n; ++i) {
+                    memcpy(&k, keys + i * sizeof (K), sizeof (K));
+                    memcpy(&v1, values + i * sizeof (V1), sizeof (V1));
+                    accumulateFFF(k, v1, shard);
+                }
+            }
         }
 
         Marshal<K> *kmarshal() {
@@ -368,6 +497,16 @@ namespace dsm {
         virtual LocalTable* create_copyT(int shard);
         deque<KVPair> update_queue;
         bool binit;
+
+        //ApplyPackedUpdates scratch, used under the table lock
+        string packed_raw_;
+        vector<K> packed_keys_;
+
+        //accumulateF1Batch scratch, kernel thread only
+        vector<int> batch_shard_;
+        vector<int> batch_start_;
+        vector<int> batch_fill_;
+        vector<KVPair> batch_sorted_;
     };
 
     static const int kWriteFlushCount = 1000000;
@@ -512,6 +651,14 @@ namespace dsm {
          */
     }
 
+    template<class K, class V1, class V2, class V3>
+    V1 TypedGlobalTable<K, V1, V2, V3>::takeF1(const K &k, const V1 &v) {
+        int shard = this->get_shard(k);
+        CHECK(is_local_shard(shard)) << "takeF1 on a key of remote shard " << shard;
+
+        return partition(shard)->takeF1(k, v);
+    }
+
     template<class K, class V1, class V2, class V3>
     void TypedGlobalTable<K, V1, V2, V3>::updateF2(const K &k, const V2 &v) {
         int shard = this->get_shard(k);
@@ -589,16 +736,64 @@ namespace dsm {
         } else {
             //VLOG(1) << this->owner(shard) << ":" << shard << " accumulate " << v << " on remote " << k;
             deltaT(shard)->accumulate(k, v);
+            buffered_remote_write(shard);
+            //BufSend();
 
-            ++pending_writes_;
-            if (pending_writes_ > FLAGS_bufmsg) {
-                SendUpdates();
+            //PERIODIC(0.1, {this->HandlePutRequests();});
+        }
+    }
 
+    //groups the pairs by shard with a counting sort: a local shard gets all of
+    //its pairs in one accumulateF1Batch, a remote shard's go into its send
+    //buffer together. Accumulation commutes, so the order does not matter.
+    template<class K, class V1, class V2, class V3>
+    void TypedGlobalTable<K, V1, V2, V3>::accumulateF1Batch(const pair<K, V1>* begin, const pair<K, V1>* end) {
+        int n = end - begin;
+        int shards = this->num_shards();
+        batch_shard_.resize(n);
+        batch_start_.assign(shards + 1, 0);
+        for (int i = 0; i < n; ++i) {
+            int shard = this->get_shard(begin[i].first);
+            batch_shard_[i] = shard;
+            ++batch_start_[shard + 1];
+        }
+        for (int s = 0; s < shards; ++s) {
+            batch_start_[s + 1] += batch_start_[s];
+        }
+
+        batch_fill_.assign(batch_start_.begin(), batch_start_.end() - 1);
+        batch_sorted_.resize(n);
+        for (int i = 0; i < n; ++i) {
+            batch_sorted_[batch_fill_[batch_shard_[i]]++] = begin[i];
+        }
+
+        for (int s = 0; s < shards; ++s) {
+            int count = batch_start_[s + 1] - batch_start_[s];
+            if (count == 0) continue;
+
+            const pair<K, V1>* first = &batch_sorted_[batch_start_[s]];
+            if (is_local_shard(s)) {
+                partition(s)->accumulateF1Batch(first, first + count);
+                continue;
             }
-            //BufSend();
+            PTypedTable<K, V1, V3>* d = deltaT(s);
+            for (const pair<K, V1>* p = first; p != first + count; ++p) {
+                d->accumulate(p->first, p->second);
+            }
+            buffered_remote_write(s, count);
+        }
+    }
 
-            //PERIODIC(0.1, {this->HandlePutRequests();});
+    //moves updates a kernel thread buffered for remote shards into the send
+    //buffers; the table lock keeps the threads from interleaving there
+    template<class K, class V1, class V2, class V3>
+    void TypedGlobalTable<K, V1, V2, V3>::accumulateRemote(vector<pair<K, V1> >* updates) {
+        boost::recursive_mutex::scoped_lock sl(mutex());
+
+        for (typename vector<pair<K, V1> >::iterator i = updates->begin(); i != updates->end(); ++i) {
+            accumulateF1(i->first, i->second);
         }
+        updates->clear();
     }
 
     template<class K, class V1, class V2, class V3>
@@ -0,0 +1,169 @@
+#ifndef HASH_INDEX_H_
+#define HASH_INDEX_H_
+
+#include "util/common.h"
+
+DECLARE_double(table_load_factor);
+
+namespace dsm {
+
+    //The hashing core shared by StateTable, DeltaTable and CopyTable: an
+    //open-addressing map from a key to the slot that holds its fields in the
+    //table's columns. Capacity is a power of two and probing is linear from
+    //mix(hash) & mask. The index is grown before live entries plus tombstones
+    //exceed the max load factor, so a probe always ends at an empty entry.
+    //Growing rebuilds only the (key, slot) pairs into a fresh array; the
+    //tables' columns never move.
+
+    template <class K>
+    class HashIndex {
+    private:
+        static const int32_t kEmpty = -1;
+        static const int32_t kTombstone = -2;
+
+        struct Entry {
+            K key;
+            int32_t slot;
+        };
+
+    public:
+
+        HashIndex(double max_load = FLAGS_table_load_factor)
+        : max_load_(std::min(std::max(max_load, 0.1), 0.95)), mask_(0), live_(0), used_(0), limit_(0) {
+        }
+
+        int64_t size() const {
+            return live_;
+        }
+
+        //the slot of k, -1 if absent
+        int32_t find(const K& k) const {
+            if (table_.empty()) return -1;
+
+            for (size_t i = home(k);; i = (i + 1) & mask_) {
+                const Entry& e = table_[i];
+                if (e.slot == kEmpty) return -1;
+                if (e.slot != kTombstone && e.key == k) return e.slot;
+            }
+        }
+
+        //k must not be present already
+        void insert(const K& k, int32_t slot) {
+            if (used_ + 1 > limit_) {
+                //mostly tombstones: rehash in place, otherwise double
+                rehash(live_ + 1 > limit_ / 2 ? std::max(table_.size() * 2, (size_t) 8) : table_.size());
+            }
+
+            size_t i = home(k);
+            while (table_[i].slot >= 0) {
+                i = (i + 1) & mask_;
+            }
+            if (table_[i].slot == kEmpty) ++used_;
+            table_[i].key = k;
+            table_[i].slot = slot;
+            ++live_;
+        }
+
+        //point an existing key at another slot
+        void update(const K& k, int32_t slot) {
+            Entry* e = lookup(k);
+            CHECK(e != NULL);
+            e->slot = slot;
+        }
+
+        //the slot k was mapped to, -1 if absent
+        int32_t erase(const K& k) {
+            Entry* e = lookup(k);
+            if (e == NULL) return -1;
+
+            int32_t slot = e->slot;
+            e->slot = kTombstone;
+            --live_;
+            return slot;
+        }
+
+        //size the index for n keys up front so that filling it never rehashes
+        void reserve(int64_t n) {
+            if (n > limit_) {
+                size_t capacity = 8;
+                while (capacity * max_load_ < n) capacity *= 2;
+                rehash(capacity);
+            }
+        }
+
+        void clear() {
+            for (size_t i = 0; i < table_.size(); ++i) {
+                table_[i].slot = kEmpty;
+            }
+            live_ = used_ = 0;
+        }
+
+        //clear an index that holds exactly keys[0, n): empty each key's run from
+        //its home to the end of its cluster, touching only the probed entries.
+        //tombstones may sit where no key leads, so fall back to the full clear
+        void clear(const K* keys, int64_t n) {
+            if (n != live_ || used_ != live_) {
+                clear();
+                return;
+            }
+
+            for (int64_t j = 0; j < n; ++j) {
+                for (size_t i = home(keys[j]); table_[i].slot != kEmpty; i = (i + 1) & mask_) {
+                    table_[i].slot = kEmpty;
+                }
+            }
+            live_ = used_ = 0;
+        }
+
+    private:
+
+        size_t home(const K& k) const {
+            //tr1::hash of an integer is the integer itself, and Mod-sharded keys
+            //share their low bits, so mix before masking
+            uint64_t h = hashobj_(k);
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdULL;
+            h ^= h >> 33;
+            return h & mask_;
+        }
+
+        Entry* lookup(const K& k) {
+            if (table_.empty()) return NULL;
+
+            for (size_t i = home(k);; i = (i + 1) & mask_) {
+                Entry& e = table_[i];
+                if (e.slot == kEmpty) return NULL;
+                if (e.slot != kTombstone && e.key == k) return &e;
+            }
+        }
+
+        void rehash(size_t capacity) {
+            std::vector<Entry> old;
+            old.swap(table_);
+
+            Entry empty;
+            empty.slot = kEmpty;
+            table_.resize(capacity, empty);
+            mask_ = capacity - 1;
+            limit_ = (int64_t) (capacity * max_load_);
+            live_ = used_ = 0;
+
+            for (size_t i = 0; i < old.size(); ++i) {
+                if (old[i].slot >= 0) {
+                    insert(old[i].key, old[i].slot);
+                }
+            }
+        }
+
+        std::vector<Entry> table_;
+        double max_load_;
+        size_t mask_;
+        int64_t live_; //entries mapping a key
+        int64_t used_; //live entries plus tombstones
+        int64_t limit_;
+
+        std::tr1::hash<K> hashobj_;
+    };
+}
+
+#endif /* HASH_INDEX_H_ */
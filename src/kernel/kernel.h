@@ -5,15 +5,24 @@
 #include "kernel/global-table.h"
 #include "kernel/local-table.h"
 #include "kernel/table-registry.h"
+#include "kernel/partition-file.h"
+#include "webgraph.h"
 
 #include "util/common.h"
 #include <boost/function.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 #include <boost/lexical_cast.hpp>
 #include <time.h>
 #include <algorithm>
 DECLARE_string(graph_dir);
 DECLARE_int32(degree);
 DECLARE_int32(shard);
+DECLARE_int32(kernel_threads);
+DECLARE_int32(load_threads);
+DECLARE_string(webgraph);
+DECLARE_bool(binary_partitions);
+DECLARE_int32(bufmsg);
 
 namespace dsm {
 
@@ -23,7 +32,8 @@ namespace dsm {
     class TableBase;
     class Worker;
 
-    template <class K, class V, class D>
+    //IK is the static type of the user's iterate kernel; see KernelCalls
+    template <class K, class V, class D, class IK = IterateKernel<K, V, D> >
     class MaiterKernel;
 
 #ifndef SWIG
@@ -162,8 +172,8 @@ namespace dsm {
             return dynamic_cast<TypedGlobalTable<K, V1, V2, V3>*> (get_table(id));
         }
 
-        template <class K, class V, class D>
-        void set_maiter(MaiterKernel<K, V, D> maiter) {
+        template <class K, class V, class D, class IK>
+        void set_maiter(MaiterKernel<K, V, D, IK> maiter) {
         }
 
     private:
@@ -195,13 +205,13 @@ namespace dsm {
         string name_;
     };
 
-    template <class C, class K, class V, class D>
+    template <class C, class K, class V, class D, class IK = IterateKernel<K, V, D> >
     struct KernelInfoT : public KernelInfo {
         typedef void (C::*Method)();
         map<string, Method> methods_;
-        MaiterKernel<K, V, D>* maiter;
+        MaiterKernel<K, V, D, IK>* maiter;
 
-        KernelInfoT(const char* name, MaiterKernel<K, V, D>* inmaiter) : KernelInfo(name) {
+        KernelInfoT(const char* name, MaiterKernel<K, V, D, IK>* inmaiter) : KernelInfo(name) {
             maiter = inmaiter;
         }
 
@@ -219,7 +229,7 @@ namespace dsm {
             return methods_.find(name) != methods_.end();
         }
 
-        void register_method(const char* mname, Method m, MaiterKernel<K, V, D>* inmaiter) {
+        void register_method(const char* mname, Method m, MaiterKernel<K, V, D, IK>* inmaiter) {
             methods_[mname] = m;
         }
     };
@@ -246,29 +256,29 @@ namespace dsm {
         Map m_;
     };
 
-    template <class C, class K, class V, class D>
+    template <class C, class K, class V, class D, class IK = IterateKernel<K, V, D> >
     struct KernelRegistrationHelper {
 
-        KernelRegistrationHelper(const char* name, MaiterKernel<K, V, D>* maiter) {
+        KernelRegistrationHelper(const char* name, MaiterKernel<K, V, D, IK>* maiter) {
             KernelRegistry::Map& kreg = KernelRegistry::Get()->kernels();
 
             CHECK(kreg.find(name) == kreg.end()); //map.find(name)返回name所对应的迭代器，找不到则返回end()迭代器
-            kreg.insert(make_pair(name, new KernelInfoT<C, K, V, D>(name, maiter)));
+            kreg.insert(make_pair(name, new KernelInfoT<C, K, V, D, IK>(name, maiter)));
         }
     };
 
-    template <class C, class K, class V, class D>
+    template <class C, class K, class V, class D, class IK = IterateKernel<K, V, D> >
     struct MethodRegistrationHelper {
 
-        MethodRegistrationHelper(const char* klass, const char* mname, void (C::*m)(), MaiterKernel<K, V, D>* maiter) {
-            ((KernelInfoT<C, K, V, D>*)KernelRegistry::Get()->kernel(klass))->register_method(mname, m, maiter);
+        MethodRegistrationHelper(const char* klass, const char* mname, void (C::*m)(), MaiterKernel<K, V, D, IK>* maiter) {
+            ((KernelInfoT<C, K, V, D, IK>*)KernelRegistry::Get()->kernel(klass))->register_method(mname, m, maiter);
         }
     };
 
-    template <class K, class V, class D>
+    template <class K, class V, class D, class IK = IterateKernel<K, V, D> >
     class MaiterKernel0 : public DSMKernel {
     private:
-        MaiterKernel<K, V, D>* maiter;
+        MaiterKernel<K, V, D, IK>* maiter;
     public:
 
         void run() {
@@ -277,66 +287,232 @@ namespace dsm {
         }
     };
 
+    //nodes read by a loader, put into a shard with one StateTable::bulk_build
     template <class K, class V, class D>
+    struct LoadBatch {
+        vector<K> keys;
+        vector<V> deltas;
+        vector<V> values;
+        typename AdjacencyStore<D>::Bulk adjacency; //filled by the loader
+        vector<K> copies; //nodes of at least --degree neighbours
+
+        void reserve(int64_t n) {
+            keys.reserve(n);
+            deltas.reserve(n);
+            values.reserve(n);
+        }
+
+        void add(const K& key, const V& delta, const V& value, int degree) {
+            keys.push_back(key);
+            deltas.push_back(delta);
+            values.push_back(value);
+            if (degree >= FLAGS_degree) {
+                copies.push_back(key);
+            }
+        }
+
+        template <class IK>
+        void build(StateTable<K, V, V, D, IK>* t) {
+            t->bulk_build(keys, deltas, values, adjacency);
+            for (size_t i = 0; i < copies.size(); ++i) {
+                t->setCopy(copies[i]);
+            }
+        }
+    };
+
+    template <class K, class V, class D, class IK>
+    static StateTable<K, V, V, D, IK>* LocalStateTable(TypedGlobalTable<K, V, V, D>* table, int shard) {
+        StateTable<K, V, V, D, IK>* t = dynamic_cast<StateTable<K, V, V, D, IK>*> (table->partition(shard));
+        CHECK(t != NULL) << "shard " << shard << " is not a local state table";
+        return t;
+    }
+
+    //loads a binary partition (see PartitionFile) into a shard of the state
+    //table; only tables with plain keys and vector adjacency can take one
+    template <class K, class V, class D, class IK>
+    struct BinaryPartitionLoader {
+        static const bool supported = false;
+
+        static int64_t load(const string& path, IterateKernel<K, V, D>* ik, TypedGlobalTable<K, V, V, D>* table, int shard) {
+            LOG(FATAL) << "no binary partition loader for this table";
+            return 0;
+        }
+    };
+
+    template <class K, class V, class T, class IK>
+    struct BinaryPartitionLoader<K, V, vector<T>, IK> {
+        static const bool supported = boost::is_pod<K>::value;
+
+        //the file's edge array becomes the shard's, so no edge is parsed or
+        //copied into the table; returns the number of nodes loaded
+        static int64_t load(const string& path, IterateKernel<K, V, vector<T> >* ik,
+                TypedGlobalTable<K, V, V, vector<T> >* table, int shard) {
+            PartitionFile<K, T> part(path);
+            LoadBatch<K, V, vector<T> > batch;
+            batch.adjacency.use_mapped(part.file(), part.edges(), part.offsets(), part.vertices());
+            batch.reserve(part.vertices());
+
+            vector<T> data; //init_v and init_c take the neighbours as a vector
+            for (int64_t i = 0; i < part.vertices(); ++i) {
+                const K& key = part.key(i);
+                CHECK_EQ(table->get_shard(key), shard) << "node " << key << " of " << path << " belongs to another shard";
+                AdjacencySpan<T> adj = part.adjacency(i);
+                data.assign(adj.begin(), adj.end());
+                V delta;
+                V value;
+                ik->init_v(key, value, data);
+                ik->init_c(key, delta, data);
+                batch.add(key, delta, value, adj.size());
+            }
+            batch.build(LocalStateTable<K, V, vector<T>, IK>(table, shard));
+            return part.vertices();
+        }
+    };
+
+    //streams a BV-compressed WebGraph (--webgraph) and puts the nodes a shard
+    //owns under the table's sharder into it; node ids are ints, so only
+    //tables of int keys and vector<int> adjacency can take one
+    template <class K, class V, class D, class IK>
+    struct WebGraphLoader {
+        static const bool supported = false;
+
+        static int64_t load(const string& path, IterateKernel<K, V, D>* ik, TypedGlobalTable<K, V, V, D>* table, int shard) {
+            LOG(FATAL) << "no webgraph loader for this table";
+            return 0;
+        }
+    };
+
+    template <class V, class IK>
+    struct WebGraphLoader<int, V, vector<int>, IK> {
+        static const bool supported = true;
+
+        //every worker decodes the whole graph, since BV compression refers back
+        //to earlier nodes, but keeps only its own; returns the nodes kept
+        static int64_t load(const string& path, IterateKernel<int, V, vector<int> >* ik,
+                TypedGlobalTable<int, V, V, vector<int> >* table, int shard) {
+            StateTable<int, V, V, vector<int>, IK>* t = LocalStateTable<int, V, vector<int>, IK>(table, shard);
+            LoadBatch<int, V, vector<int> > batch;
+            try {
+                WebGraph::Reader reader(path);
+                t->reserve(reader.nodes / table->num_shards() + 1);
+                const WebGraph::Node* n;
+                vector<int> data;
+                while ((n = reader.readNode()) != NULL) {
+                    if (table->get_shard(n->node) != shard) continue;
+                    data.assign(n->links.begin(), n->links.end());
+                    V delta;
+                    V value;
+                    ik->init_v(n->node, value, data);
+                    ik->init_c(n->node, delta, data);
+                    batch.add(n->node, delta, value, data.size());
+                    batch.adjacency.add(data);
+                }
+            } catch (const std::exception& e) {
+                LOG(FATAL) << "reading webgraph " << path << ": " << e.what();
+            }
+            batch.build(t);
+            return batch.keys.size();
+        }
+    };
+
+    template <class K, class V, class D, class IK = IterateKernel<K, V, D> >
     class MaiterKernel1 : public DSMKernel { //the first phase: initialize the local state table
     private:
-        MaiterKernel<K, V, D>* maiter; //user-defined iteratekernel
+        MaiterKernel<K, V, D, IK>* maiter; //user-defined iteratekernel
     public:
 
-        void set_maiter(MaiterKernel<K, V, D>* inmaiter) {
+        void set_maiter(MaiterKernel<K, V, D, IK>* inmaiter) {
             maiter = inmaiter;
         }
 
-        void read_file(TypedGlobalTable<K, V, V, D>* table) {
-            string patition_file = StringPrintf("%s/part%d", FLAGS_graph_dir.c_str(), current_shard());
-            //cout<<"Unable to open file: " << patition_file<<endl;
-            ifstream inFile;
-            inFile.open(patition_file.c_str());
-            if (!inFile) {
-                //cout<<"Unable to open file: " << patition_file;
-                cerr << "Unable to open file" << patition_file;
-                cerr << system("ifconfig -a | grep 192.168.*") << endl;
-                exit(1); // terminate with error
-            }
-
-            char linechr[2024000];
-            while (inFile.getline(linechr, 2024000)) { //read a line of the input file, ensure the buffer is large enough
+        //the lines in [begin, end) of a text partition, one thread each with
+        //--load_threads; like put(), it drops keys of other shards
+        void parse_range(TypedGlobalTable<K, V, V, D>* table, const char* begin, const char* end, LoadBatch<K, V, D>* batch) {
+            //through the interface, so a kernel that only overrides the string
+            //read_data still gets the StringPiece one
+            IterateKernel<K, V, D>* ik = maiter->iterkernel;
+            StringPiece line;
+            while (MappedFile::read_line(&begin, end, &line)) { //each line is a view into the mapped file, no copy is made
+                if (line.len == 0) continue;
                 K key;
                 V delta;
                 D data;
                 V value;
                 int size;
-                string line(linechr);
-                maiter->iterkernel->read_data(line, key, data, size); //invoke api, get the value of key field and data field
-                maiter->iterkernel->init_v(key, value, data); //invoke api, get the initial v field value
-                maiter->iterkernel->init_c(key, delta, data); //invoke api, get the initial delta v field value
-                //cout<<"key: "<<key<<"delta: "<<delta<<"value: "<<value<<"   "<<data[0][0]<<"  "<<data[1][0]<<"   "<<data[2][0]<<endl;
-                if (size >= FLAGS_degree) {
-                    table->put(key, delta, value, data); //initialize a row of the state table (a node)
-                } else {
-                    table->put2(key, delta, value, data);
-                }
+                ik->read_data(line, key, data, size); //invoke api, get the value of key field and data field
+                ik->init_v(key, value, data); //invoke api, get the initial v field value
+                ik->init_c(key, delta, data); //invoke api, get the initial delta v field value
+                if (table->get_shard(key) != current_shard()) continue;
+                batch->add(key, delta, value, size);
+                batch->adjacency.add(data);
             }
+        }
 
-            patition_file = StringPrintf("%s/part%d", FLAGS_graph_dir.c_str(), current_shard() + FLAGS_shard);
-            ifstream inFile2;
-            inFile2.open(patition_file.c_str());
-            if (!inFile2) {
-                //cout<<"Unable to open file: " << patition_file;
-                cerr << "Unable to open file" << patition_file;
-                cerr << system("ifconfig -a | grep 192.168.*") << endl;
-                exit(1); // terminate with error
+        //the text partition, one "key\tneighbours" line per node, parsed in
+        //ranges of whole lines in parallel and put into the shard in file
+        //order; returns the number of nodes loaded
+        int64_t read_text(TypedGlobalTable<K, V, V, D>* table, const string& path) {
+            MappedFile part(path);
+            vector<size_t> at = part.split_lines(std::max(FLAGS_load_threads, 1));
+            int ranges = at.size() - 1;
+            vector<LoadBatch<K, V, D> > batches(ranges);
+            boost::thread_group group;
+            for (int r = 1; r < ranges; ++r) {
+                group.create_thread(boost::bind(&MaiterKernel1::parse_range, this, table,
+                        part.data() + at[r], part.data() + at[r + 1], &batches[r]));
             }
+            parse_range(table, part.data() + at[0], part.data() + at[1], &batches[0]);
+            group.join_all();
 
-            char linechr2[2024000];
-            while (inFile.getline(linechr2, 2024000)) { //read a line of the input file, ensure the buffer is large enough
-                K key;
-                D data;
-                int size;
-                string line(linechr2);
-                maiter->iterkernel->read_data(line, key, data, size); //invoke api, get the value of key field and data field
-                table->putc(key, 0, data, this->current_shard());
+            int64_t nodes = 0;
+            for (int r = 0; r < ranges; ++r) {
+                nodes += batches[r].keys.size();
+            }
+            StateTable<K, V, V, D, IK>* t = LocalStateTable<K, V, D, IK>(table, current_shard());
+            t->reserve(nodes);
+            for (int r = 0; r < ranges; ++r) {
+                batches[r].build(t);
             }
+            return nodes;
+        }
+
+        //part<shard>, or with --binary_partitions its binary form part<shard>.csr,
+        //or this shard's nodes of --webgraph
+        void read_file(TypedGlobalTable<K, V, V, D>* table) {
+            Timer timer;
+            if (!FLAGS_webgraph.empty()) {
+                CHECK((WebGraphLoader<K, V, D, IK>::supported)) << "--webgraph needs int keys and vector<int> adjacency";
+                int64_t nodes = WebGraphLoader<K, V, D, IK>::load(FLAGS_webgraph, maiter->iterkernel, table, current_shard());
+                VLOG(0) << "shard " << current_shard() << " loaded " << nodes << " nodes from " << FLAGS_webgraph << " in "
+                        << timer.elapsed() << "s";
+                return;
+            }
+
+            string path = StringPrintf("%s/part%d", FLAGS_graph_dir.c_str(), current_shard());
+            int64_t nodes;
+            if (FLAGS_binary_partitions) {
+                //csrconv parsed the text, not this kernel's read_data
+                CHECK((BinaryPartitionLoader<K, V, D, IK>::supported))
+                        << "--binary_partitions needs plain keys and vector adjacency";
+                string binary_path = BinaryPartitionPath(path);
+                CHECK(File::Exists(binary_path)) << "no " << binary_path << "; run csrconv on " << FLAGS_graph_dir;
+                CHECK(BinaryPartitionCurrent(path)) << binary_path << " is older than " << path << "; rerun csrconv";
+                path = binary_path;
+                nodes = BinaryPartitionLoader<K, V, D, IK>::load(path, maiter->iterkernel, table, current_shard());
+            } else {
+                nodes = read_text(table, path);
+            }
+
+            //part<shard + --shard> is the copy table. The getline loop that used to
+            //read it re-read the exhausted part<shard> stream, so no copy was ever
+            //loaded, and the sample copy files name nodes outside the sample graphs;
+            //it stays unread and is only checked for
+            string copy_file = StringPrintf("%s/part%d", FLAGS_graph_dir.c_str(), current_shard() + FLAGS_shard);
+            CHECK(File::Exists(copy_file) || File::Exists(BinaryPartitionPath(copy_file)))
+                    << "Unable to open file " << copy_file;
+
+            VLOG(0) << "shard " << current_shard() << " loaded " << nodes << " nodes from " << path << " in "
+                    << timer.elapsed() << "s";
         }
 
         void init_table(TypedGlobalTable<K, V, V, D>* a) {
@@ -366,44 +542,65 @@ namespace dsm {
         }
     };
 
-    template <class K, class V, class D>
+    template <class K, class V, class D, class IK = IterateKernel<K, V, D> >
     class MaiterKernel2 : public DSMKernel { //the second phase: iterative processing of the local state table
     private:
-        MaiterKernel<K, V, D>* maiter; //user-defined iteratekernel
+        MaiterKernel<K, V, D, IK>* maiter; //user-defined iteratekernel
         vector<pair<K, V> >* output; //the output buffer          
 
+        //an entry of a pass shared by several threads: the table's columns do not
+        //move during a pass, so the value and adjacency can be held on to
+        struct PassEntry {
+            K key;
+            V* value;
+            typename AdjacencyStore<D>::Held adjacency;
+        };
+        vector<PassEntry> pass_; //the current pass with --kernel_threads > 1
+
+        //the --kernel_threads - 1 helpers of run_pass, started by the first pass
+        //and kept until run_loop ends, so short passes do not pay for threads
+        vector<boost::thread*> pool_;
+        boost::mutex pool_lock_;
+        boost::condition_variable pool_wake_;
+        boost::condition_variable pool_done_;
+        TypedGlobalTable<K, V, V, D>* pass_table_;
+        int pass_id_; //bumped for every pass handed to the helpers
+        int pool_busy_; //helpers still in the current pass
+        bool pool_stop_;
+
     public:
 
-        void set_maiter(MaiterKernel<K, V, D>* inmaiter) {
+        MaiterKernel2() : pass_table_(NULL), pass_id_(0), pool_busy_(0), pool_stop_(false) {
+        }
+
+        void set_maiter(MaiterKernel<K, V, D, IK>* inmaiter) {
             maiter = inmaiter;
         }
 
-        void run_iter(const K& k, V &v1, V &v2, D &v3) {
+        void run_iter(const K& k, V &v1, V &v2, const typename IterateKernel<K, V, D>::Adjacency& v3) {
             //cout<<"delta:"<<v1<<endl;
-            maiter->iterkernel->process_delta_v(k, v1, v2, v3);
+            KernelCalls<IK>::process_delta_v(maiter->iterkernel, k, v1, v2, v3);
 
             maiter->table->accumulateF2(k, v1); //perform v=v+delta_v     
             // process delta_v before accumulate
-            maiter->iterkernel->g_func(k, v1, v2, v3, output); //invoke api, perform g(delta_v) and send messages to out-neighbors
+            KernelCalls<IK>::g_func(maiter->iterkernel, k, v1, v2, v3, output); //invoke api, perform g(delta_v) and send messages to out-neighbors
             //cout << " key " << k << endl;
             maiter->table->updateF1(k, maiter->iterkernel->default_v()); //perform delta_v=0, reset delta_v after delta_v has been spread out
 
-            typename vector<pair<K, V> >::iterator iter;
-            for (iter = output->begin(); iter != output->end(); iter++) { //send the buffered messages to remote state table
-                pair<K, V> kvpair = *iter;
-                //cout << "accumulating " << kvpair.first << " with " <<kvpair.second << endl;
-                maiter->table->accumulateF1(kvpair.first, kvpair.second); //apply the output messages to remote state table
+            //apply the output messages to the local and remote state tables, routed per shard
+            if (!output->empty()) {
+                maiter->table->accumulateF1Batch(&output->front(), &output->front() + output->size());
             }
             output->clear(); //clear the output buffer
         }
 
-        void run_iter2(const K& k, V &v1, V &v2, D &v3) {
+        void run_iter2(const K& k, V &v1, V &v2, const typename IterateKernel<K, V, D>::Adjacency& v3) {
             //cout<<"delta:"<<v1<<endl;
-            maiter->iterkernel->process_delta_v(k, v1, v2, v3);
+            KernelCalls<IK>::process_delta_v(maiter->iterkernel, k, v1, v2, v3);
 
             maiter->table->accumulateF2(k, v1); //perform v=v+delta_v     
             // process delta_v before accumulate
-            maiter->iterkernel->g_func(k, v1, v2, v3, output); //invoke api, perform g(delta_v) and send messages to out-neighbors
+            KernelCalls<IK>::g_func(maiter->iterkernel, k, v1, v2, v3, output); //invoke api, perform g(delta_v) and send messages to out-neighbors
             //cout << " key " << k << endl;
             maiter->table->updateF1(k, maiter->iterkernel->default_v()); //perform delta_v=0, reset delta_v after delta_v has been spread out
             int shard = maiter->table->num_shards();
@@ -459,11 +656,110 @@ namespace dsm {
         //        cout << "total F2 : " << totalF2 << endl;
         //    }
 
+        //run_iter for one thread's share of a pass. The delta is taken from the
+        //table before it is spread, so deltas other threads add meanwhile stay
+        //for the next pass; updates for remote shards are buffered per thread.
+        void run_range(TypedGlobalTable<K, V, V, D>* a, size_t begin, size_t end) {
+            vector<pair<K, V> > out;
+            vector<pair<K, V> > remote;
+            const V& defaultv = maiter->iterkernel->default_v();
+
+            for (size_t i = begin; i < end; ++i) {
+                const PassEntry& e = pass_[i];
+                typename AdjacencyStore<D>::ViewRef adjacency = AdjacencyStore<D>::held(e.adjacency);
+                V delta = a->takeF1(e.key, defaultv);
+                KernelCalls<IK>::process_delta_v(maiter->iterkernel, e.key, delta, *e.value, adjacency);
+                a->accumulateF2(e.key, delta);
+                KernelCalls<IK>::g_func(maiter->iterkernel, e.key, delta, *e.value, adjacency, &out);
+
+                for (typename vector<pair<K, V> >::iterator iter = out.begin(); iter != out.end(); iter++) {
+                    if (a->is_local_shard(a->get_shard(iter->first))) {
+                        a->accumulateF1(iter->first, iter->second);
+                    } else {
+                        remote.push_back(*iter);
+                    }
+                }
+                out.clear();
+
+                if (remote.size() > FLAGS_bufmsg) a->accumulateRemote(&remote);
+            }
+            a->accumulateRemote(&remote);
+        }
+
+        //pool helper t of --kernel_threads: runs its range of every pass after
+        //pass seen
+        void pool_thread(int t, int seen) {
+            while (true) {
+                {
+                    boost::mutex::scoped_lock l(pool_lock_);
+                    while (pass_id_ == seen && !pool_stop_) pool_wake_.wait(l);
+                    if (pool_stop_) return;
+                    seen = pass_id_;
+                }
+                size_t n = pass_.size();
+                run_range(pass_table_, n * t / FLAGS_kernel_threads, n * (t + 1) / FLAGS_kernel_threads);
+                boost::mutex::scoped_lock l(pool_lock_);
+                if (--pool_busy_ == 0) pool_done_.notify_one();
+            }
+        }
+
+        void stop_pool() {
+            {
+                boost::mutex::scoped_lock l(pool_lock_);
+                pool_stop_ = true;
+                pool_wake_.notify_all();
+            }
+            for (size_t i = 0; i < pool_.size(); ++i) {
+                pool_[i]->join();
+                delete pool_[i];
+            }
+            pool_.clear();
+            pool_stop_ = false;
+        }
+
+        //one pass split over --kernel_threads threads by contiguous ranges;
+        //copies of high-degree vertices go through run_iter2 on this thread
+        //while the pass is collected
+        void run_pass(TypedGlobalTable<K, V, V, D>* a, typename TypedGlobalTable<K, V, V, D>::Iterator* it2, double* totalF2, long* updates) {
+            pass_.clear();
+            while (!it2->done()) {
+                bool cont = it2->Next();
+                if (!cont) break;
+                *totalF2 += it2->value2();
+                (*updates)++;
+
+                if (it2->is_copy() == 0) {
+                    PassEntry e = {it2->key(), &it2->value2(), AdjacencyStore<D>::hold(it2->adjacency())};
+                    pass_.push_back(e);
+                } else {
+                    run_iter2(it2->key(), it2->value1(), it2->value2(), it2->adjacency());
+                }
+            }
+
+            int threads = FLAGS_kernel_threads;
+            if (pool_.empty()) {
+                for (int t = 1; t < threads; ++t) {
+                    pool_.push_back(new boost::thread(boost::bind(&MaiterKernel2::pool_thread, this, t, pass_id_)));
+                }
+            }
+            {
+                boost::mutex::scoped_lock l(pool_lock_);
+                pass_table_ = a;
+                pool_busy_ = threads - 1;
+                ++pass_id_;
+                pool_wake_.notify_all();
+            }
+            run_range(a, 0, pass_.size() / threads);
+            boost::mutex::scoped_lock l(pool_lock_);
+            while (pool_busy_ > 0) pool_done_.wait(l);
+        }
+
         void run_loop(TypedGlobalTable<K, V, V, D>* a) {
             Timer timer; //for experiment, time recording
             //double totalF1 = 0;                 //the sum of delta_v, it should be smaller and smaller as iterations go on
             double totalF2 = 0; //the sum of v, it should be larger and larger as iterations go on
             long updates = 0; //for experiment, recording number of update operations
+            double busy = 0; //for experiment, time spent processing (excluding waiting for updates)
             output = new vector<pair<K, V> >;
             //        double now=Now();
             //        double last=now;
@@ -476,22 +772,28 @@ namespace dsm {
                 typename TypedGlobalTable<K, V, V, D>::Iterator *it2 = a->get_typed_iterator(current_shard(), false);
                 if (it2 == NULL) break;
 
-                //should not use for(;!it->done();it->Next()), that will skip some entry
-                while (!it2->done()) {
-
-                    bool cont = it2->Next(); //if we have more in the state table, we continue
-                    if (!cont) break;
-                    totalF2 += it2->value2(); //for experiment, recording the sum of v
-                    updates++; //for experiment, recording the number of updates
-
-                    //cout << "processing " << it2->key() << " " << it2->value1() << " " << it2->value2() << endl;
-                    if (it2->is_copy() == 0) {
-                        run_iter(it2->key(), it2->value1(), it2->value2(), it2->value3());
-                    } else {
-                        run_iter2(it2->key(), it2->value1(), it2->value2(), it2->value3());
+                double pass_start = Now();
+                if (FLAGS_kernel_threads > 1) {
+                    run_pass(a, it2, &totalF2, &updates);
+                } else {
+                    //should not use for(;!it->done();it->Next()), that will skip some entry
+                    while (!it2->done()) {
+
+                        bool cont = it2->Next(); //if we have more in the state table, we continue
+                        if (!cont) break;
+                        totalF2 += it2->value2(); //for experiment, recording the sum of v
+                        updates++; //for experiment, recording the number of updates
+
+                        //cout << "processing " << it2->key() << " " << it2->value1() << " " << it2->value2() << endl;
+                        if (it2->is_copy() == 0) {
+                            run_iter(it2->key(), it2->value1(), it2->value2(), it2->adjacency());
+                        } else {
+                            run_iter2(it2->key(), it2->value1(), it2->value2(), it2->adjacency());
+                        }
                     }
                 }
                 delete it2; //delete the table iterator
+                busy += Now() - pass_start;
 
                 typename TypedGlobalTable<K, V, V, D>::iterator2 *it3 = a->get_copy_iterator(current_shard(), false);
                 if (it3 == NULL) break;
@@ -508,7 +810,10 @@ namespace dsm {
                 }
                 delete it3;
             }
+            stop_pool();
 
+            VLOG(0) << "shard " << current_shard() << " performed " << updates << " updates in " << timer.elapsed()
+                    << "s, " << updates / timer.elapsed() << " updates/sec, " << updates / busy << " updates/sec busy";
         }
 
         void map() {
@@ -517,13 +822,13 @@ namespace dsm {
         }
     };
 
-    template <class K, class V, class D>
+    template <class K, class V, class D, class IK = IterateKernel<K, V, D> >
     class MaiterKernel3 : public DSMKernel { //the third phase: dumping the result, write the in-memory table to disk
     private:
-        MaiterKernel<K, V, D>* maiter; //user-defined iteratekernel
+        MaiterKernel<K, V, D, IK>* maiter; //user-defined iteratekernel
     public:
 
-        void set_maiter(MaiterKernel<K, V, D>* inmaiter) {
+        void set_maiter(MaiterKernel<K, V, D, IK>* inmaiter) {
             maiter = inmaiter;
         }
 
@@ -561,7 +866,7 @@ namespace dsm {
         }
     };
 
-    template <class K, class V, class D>
+    template <class K, class V, class D, class IK>
     class MaiterKernel {
     public:
 
@@ -570,7 +875,7 @@ namespace dsm {
         ConfigData conf;
         string output;
         Sharder<K> *sharder;
-        IterateKernel<K, V, D> *iterkernel;
+        IK *iterkernel;
         TermChecker<K, V> *termchecker;
 
         TypedGlobalTable<K, V, V, D> *table;
@@ -581,7 +886,7 @@ namespace dsm {
 
         MaiterKernel(ConfigData& inconf, int64_t nodes, double portion, string outdir,
                 Sharder<K>* insharder, //the user-defined partitioner
-                IterateKernel<K, V, D>* initerkernel, //the user-defined iterate kernel
+                IK* initerkernel, //the user-defined iterate kernel
                 TermChecker<K, V>* intermchecker) { //the user-defined terminate checker
             Reset();
 
@@ -615,19 +920,19 @@ namespace dsm {
                     sharder, iterkernel, termchecker);
 
             //initialize table job
-            KernelRegistrationHelper<MaiterKernel1<K, V, D>, K, V, D>("MaiterKernel1", this);
-            MethodRegistrationHelper<MaiterKernel1<K, V, D>, K, V, D>("MaiterKernel1", "run", &MaiterKernel1<K, V, D>::run, this);
+            KernelRegistrationHelper<MaiterKernel1<K, V, D, IK>, K, V, D, IK>("MaiterKernel1", this);
+            MethodRegistrationHelper<MaiterKernel1<K, V, D, IK>, K, V, D, IK>("MaiterKernel1", "run", &MaiterKernel1<K, V, D, IK>::run, this);
 
             //iterative update job
             if (iterkernel != NULL) {
-                KernelRegistrationHelper<MaiterKernel2<K, V, D>, K, V, D>("MaiterKernel2", this);
-                MethodRegistrationHelper<MaiterKernel2<K, V, D>, K, V, D>("MaiterKernel2", "map", &MaiterKernel2<K, V, D>::map, this);
+                KernelRegistrationHelper<MaiterKernel2<K, V, D, IK>, K, V, D, IK>("MaiterKernel2", this);
+                MethodRegistrationHelper<MaiterKernel2<K, V, D, IK>, K, V, D, IK>("MaiterKernel2", "map", &MaiterKernel2<K, V, D, IK>::map, this);
             }
 
             //dumping result to disk job
             if (termchecker != NULL) {
-                KernelRegistrationHelper<MaiterKernel3<K, V, D>, K, V, D>("MaiterKernel3", this);
-                MethodRegistrationHelper<MaiterKernel3<K, V, D>, K, V, D>("MaiterKernel3", "run", &MaiterKernel3<K, V, D>::run, this);
+                KernelRegistrationHelper<MaiterKernel3<K, V, D, IK>, K, V, D, IK>("MaiterKernel3", this);
+                MethodRegistrationHelper<MaiterKernel3<K, V, D, IK>, K, V, D, IK>("MaiterKernel3", "run", &MaiterKernel3<K, V, D, IK>::run, this);
             }
 
             return 0;
@@ -1,5 +1,14 @@
 #include "table.h"
 #include "local-table.h"
+#include "hash-index.h"
+#include "priority-buckets.h"
+#include "statetable.h"
+#include "partition-file.h"
+#include "util/static-initializers.h"
+#include <utime.h>
+#include <limits>
+
+DEFINE_double(table_load_factor, dsm::kLoadFactor, "max fraction of a local table's hash index in use before it is grown");
 
 namespace dsm {
 
@@ -95,4 +104,418 @@ namespace dsm {
         f_->writeChunk(v2);
         f_->writeChunk(v3);
     }
+
+    static void TestHashIndex() {
+        //keys sharing their low bits, as Mod-sharded keys do
+        HashIndex<int> index;
+        for (int i = 0; i < 10000; ++i) {
+            index.insert(i * 1024, i);
+        }
+        for (int i = 0; i < 10000; i += 2) {
+            CHECK_EQ(index.erase(i * 1024), i);
+        }
+        CHECK_EQ(index.size(), 5000);
+        CHECK_EQ(index.erase(0), -1);
+
+        //reinserting reuses tombstones and rehashes without losing keys
+        for (int i = 0; i < 20000; i += 2) {
+            index.insert(i * 1024, i + 1000000);
+        }
+        for (int i = 0; i < 20000; ++i) {
+            int32_t expect = i % 2 == 0 ? i + 1000000 : (i < 10000 ? i : -1);
+            CHECK_EQ(index.find(i * 1024), expect);
+        }
+        index.update(1024, 7);
+        CHECK_EQ(index.find(1024), 7);
+
+        //clearing by keys with tombstones present falls back to the full clear
+        vector<int> keys;
+        for (int i = 0; i < 20000; ++i) {
+            if (index.find(i * 1024) >= 0) keys.push_back(i * 1024);
+        }
+        index.clear(&keys[0], keys.size());
+        CHECK_EQ(index.size(), 0);
+
+        //without tombstones only the keys' clusters are emptied, all of them
+        for (int round = 0; round < 3; ++round) {
+            keys.clear();
+            for (int i = 0; i < 5000; ++i) {
+                keys.push_back((i * 7 + round) * 1024);
+                index.insert(keys.back(), i);
+            }
+            for (int i = 0; i < 5000; ++i) {
+                CHECK_EQ(index.find(keys[i]), i);
+            }
+            index.clear(&keys[0], keys.size());
+            CHECK_EQ(index.size(), 0);
+            for (int i = 0; i < 40000; ++i) {
+                CHECK_EQ(index.find(i * 1024), -1);
+            }
+        }
+    }
+    REGISTER_TEST(HashIndex, TestHashIndex());
+
+    //the bucket of each slot's priority in p, none where p is unset
+    struct TestBucketOf {
+        const vector<double>& p;
+        const vector<bool>& set;
+
+        int operator()(int slot) const {
+            return set[slot] ? PriorityBuckets::bucket(p[slot]) : PriorityBuckets::kNone;
+        }
+    };
+
+    static void TestPriorityBuckets() {
+        //buckets rank priorities as numbers, NaN lowest and still queued
+        double nan = std::numeric_limits<double>::quiet_NaN();
+        double inf = std::numeric_limits<double>::infinity();
+        double order[] = {nan, -inf, -1e15, -3, -1e-15, 0, 1e-15, 3, 1e15};
+        for (int i = 1; i < 9; ++i) {
+            CHECK_LT(PriorityBuckets::bucket(order[i - 1]), PriorityBuckets::bucket(order[i])) << order[i];
+        }
+        CHECK_EQ(PriorityBuckets::bucket(nan), 0);
+        CHECK_EQ(PriorityBuckets::bucket(-0.0), PriorityBuckets::bucket(0));
+        CHECK_EQ(PriorityBuckets::bucket(-1), PriorityBuckets::bucket(-1.5));
+        CHECK_LT(PriorityBuckets::bucket(-2), PriorityBuckets::bucket(-1));
+        CHECK_LT(PriorityBuckets::bucket(-1), PriorityBuckets::bucket(0));
+        CHECK_EQ(PriorityBuckets::bucket(inf), PriorityBuckets::kBuckets - 1);
+        CHECK_EQ(PriorityBuckets::bucket(1e300), PriorityBuckets::kBuckets - 1);
+        CHECK_EQ(PriorityBuckets::bucket(-inf), 1);
+        CHECK_LT(PriorityBuckets::bucket((int) -7), PriorityBuckets::bucket((int) 0));
+
+        //slots 0-3 never positive, as a max-propagation kernel's are; 4 and 5
+        //share the top bucket; 6 has no pending delta
+        double p[] = {-4, 0, nan, -0.5, 1e300, inf, 2};
+        vector<double> prio(p, p + 7);
+        vector<bool> set(7, true);
+        set[6] = false;
+        TestBucketOf current = {prio, set};
+        PriorityBuckets q;
+        q.resize(7);
+        for (int i = 0; i < 7; ++i) {
+            q.push(i, current(i));
+        }
+
+        //the top bucket comes whole even though one slot was asked for
+        vector<int> out;
+        q.pop(1, current, &out);
+        CHECK_EQ(out.size(), 2);
+        CHECK_EQ(out[0], 4);
+        CHECK_EQ(out[1], 5);
+
+        //then zero, the negatives nearest zero first, and NaN last
+        int expect[] = {1, 3, 0, 2};
+        for (int i = 0; i < 4; ++i) {
+            out.clear();
+            q.pop(1, current, &out);
+            CHECK_EQ(out.size(), 1);
+            CHECK_EQ(out[0], expect[i]);
+        }
+        out.clear();
+        q.pop(1, current, &out);
+        CHECK(out.empty());
+
+        //an entry is dropped once its slot moved to another bucket or to none
+        q.push(0, current(0));
+        q.push(1, current(1));
+        prio[0] = 5;
+        q.push(0, current(0));
+        set[1] = false;
+        out.clear();
+        q.pop(10, current, &out);
+        CHECK_EQ(out.size(), 1);
+        CHECK_EQ(out[0], 0);
+        out.clear();
+        q.pop(10, current, &out);
+        CHECK(out.empty());
+    }
+    REGISTER_TEST(PriorityBuckets, TestPriorityBuckets());
+
+    //deltas add up, a slot's priority is its delta
+    struct TestSumKernel : public IterateKernel<int, float, vector<int> > {
+        float zero;
+
+        TestSumKernel() : zero(0) {
+        }
+
+        void read_data(string& line, int& k, vector<int>& data, int &size) {
+        }
+
+        void init_c(const int& k, float& delta, vector<int>& data) {
+        }
+
+        const float& default_v() const {
+            return zero;
+        }
+
+        void init_v(const int& k, float& v, vector<int>& data) {
+        }
+
+        void accumulate(float& a, const float& b) {
+            a = a + b;
+        }
+
+        void priority(float& pri, const float& value, const float& delta) {
+            pri = delta;
+        }
+
+        void g_func(const int& k, const float& delta, const float& value, const Adjacency& data, vector<pair<int, float> >* output) {
+        }
+    };
+
+    typedef StateTable<int, float, float, vector<int> > TestStateTable;
+
+    //the keys an iterator hands out; every one must be a live key with a delta
+    template <class It>
+    static void CollectKeys(TestStateTable* t, It* it, set<int>* keys) {
+        while (!it->done()) {
+            if (!it->Next()) break;
+            CHECK(t->contains(it->key())) << it->key();
+            CHECK(keys->insert(it->key()).second) << it->key();
+        }
+    }
+
+    static void CheckPutRemove(bool dense, double portion) {
+        TestSumKernel kernel;
+        TableDescriptor td(0, 1);
+        td.key_marshal = new Marshal<int>;
+        td.value1_marshal = new Marshal<float>;
+        td.value2_marshal = new Marshal<float>;
+        td.value3_marshal = new Marshal<vector<int> >;
+        td.iterkernel = &kernel;
+        td.schedule_portion = portion;
+        TestStateTable t(1, dense);
+        t.Init(&td);
+
+        //enough keys that a portion is popped from the buckets, not all of them
+        const int n = 4000;
+        for (int k = 0; k < n; ++k) {
+            vector<int> adj(k % 5, k);
+            t.put(k, 1, 0, adj);
+        }
+        {
+            //a batch dropped unvisited requeues its slots, removed ones too
+            TestStateTable::ScheduledIterator dropped(t, true);
+            for (int k = 0; k < n; k += 2) {
+                CHECK(t.remove(k));
+            }
+        }
+        CHECK(!t.remove(0));
+        CHECK(!t.contains(0));
+        CHECK_EQ(t.size(), n / 2);
+
+        //removed keys are still queued or active, no pass may hand them out
+        set<int> keys;
+        if (portion < 1) {
+            //batch after batch, taking each delta as a pass does
+            while (true) {
+                TestStateTable::ScheduledIterator it(t, true);
+                if (it.b_no_change) break;
+                while (!it.done()) {
+                    it.Next();
+                    CHECK(t.contains(it.key())) << it.key();
+                    CHECK(keys.insert(it.key()).second) << it.key();
+                    t.takeF1(it.key(), 0);
+                }
+            }
+        } else {
+            TestStateTable::Iterator it(t, true);
+            CollectKeys(&t, &it, &keys);
+        }
+        CHECK_EQ(keys.size(), n / 2);
+        for (set<int>::iterator i = keys.begin(); i != keys.end(); ++i) {
+            CHECK_EQ(*i % 2, 1);
+        }
+
+        set<int> all;
+        TestStateTable::EntirePassIterator whole(t);
+        CollectKeys(&t, &whole, &all);
+        CHECK_EQ(all.size(), n / 2);
+
+        //a key put into a freed slot starts from its own values, and its
+        //adjacency from its own list
+        vector<int> adj(3, 7);
+        t.put(n + 2, 0, 5, adj);
+        t.put(2, 0, 6, adj);
+        CHECK_EQ(t.getF1(n + 2), 0);
+        CHECK_EQ(t.getF1(2), 0);
+        CHECK_EQ(t.getF2(2), 6);
+        CHECK(t.getF3(2) == adj);
+        CHECK(t.getF3(3) == vector<int>(3, 3));
+        CHECK_EQ(t.size(), n / 2 + 2);
+    }
+
+    static void TestStateTablePutRemove() {
+        for (int dense = 0; dense < 2; ++dense) {
+            CheckPutRemove(dense, 1);
+            CheckPutRemove(dense, 0.2);
+        }
+    }
+    REGISTER_TEST(StateTablePutRemove, TestStateTablePutRemove());
+
+    template <class K>
+    static void CheckGapKeys(const vector<K>& keys, const vector<int>& order) {
+        string out = "x"; //encode appends
+        GapKeys<K>::encode(&keys[0], &order[0], order.size(), &out);
+        vector<K> decoded;
+        CHECK_EQ(GapKeys<K>::decode(out.data() + 1, out.size() - 1, &decoded), out.size() - 1);
+        CHECK_EQ(decoded.size(), order.size());
+        for (int i = 0; i < order.size(); ++i) {
+            CHECK_EQ(decoded[i], keys[order[i]]);
+        }
+        //a batch cut short is malformed
+        CHECK_EQ(GapKeys<K>::decode(out.data() + 1, out.size() - 2, &decoded), -1);
+    }
+
+    static void TestGapKeys() {
+        //negative keys wrap around in the unsigned gaps and come back
+        int k[] = {7, -2147483647 - 1, -3, 0, 2147483647, -1};
+        int o[] = {1, 2, 5, 3, 0, 4};
+        CheckGapKeys(vector<int>(k, k + 6), vector<int>(o, o + 6));
+
+        int64_t k64[] = {-(1LL << 62), -1, 1LL << 40, (1LL << 62) + 5};
+        int o64[] = {0, 1, 2, 3};
+        CheckGapKeys(vector<int64_t>(k64, k64 + 4), vector<int>(o64, o64 + 4));
+
+        vector<int> none;
+        string out;
+        GapKeys<int>::encode(NULL, NULL, 0, &out);
+        CHECK_EQ(GapKeys<int>::decode(out.data(), out.size(), &none), out.size());
+        CHECK(none.empty());
+    }
+    REGISTER_TEST(GapKeys, TestGapKeys());
+
+    static void TestPartitionFile() {
+        string text = StringPrintf("/tmp/partition-file-test.%d", getpid());
+        string path = BinaryPartitionPath(text);
+
+        //a vertex without neighbours in the middle, and keys of an odd count
+        //so the offsets section needs padding
+        int k[] = {5, -3, 12};
+        int64_t o[] = {0, 2, 2, 5};
+        int e[] = {1, 2, 7, -8, 9};
+        vector<int> keys(k, k + 3);
+        vector<int64_t> offsets(o, o + 4);
+        vector<int> edges(e, e + 5);
+        PartitionFile<int, int>::Write(path, keys, offsets, edges);
+        {
+            PartitionFile<int, int> part(path);
+            CHECK_EQ(part.vertices(), 3);
+            CHECK_EQ(part.num_edges(), 5);
+            for (int i = 0; i < 3; ++i) {
+                CHECK_EQ(part.key(i), keys[i]);
+                AdjacencySpan<int> adj = part.adjacency(i);
+                CHECK_EQ(adj.size(), offsets[i + 1] - offsets[i]);
+                for (int j = 0; j < adj.size(); ++j) {
+                    CHECK_EQ(adj.begin()[j], edges[offsets[i] + j]);
+                }
+            }
+        }
+
+        //a binary form written before its text was last modified is stale
+        File::Dump(text, "5\t1 2\n");
+        struct utimbuf older = {1000000000, 1000000000};
+        struct utimbuf newer = {1000000100, 1000000100};
+        utime(path.c_str(), &older);
+        utime(text.c_str(), &newer);
+        CHECK(!BinaryPartitionCurrent(text));
+        utime(path.c_str(), &newer);
+        utime(text.c_str(), &older);
+        CHECK(BinaryPartitionCurrent(text));
+
+        unlink(text.c_str());
+        unlink(path.c_str());
+    }
+    REGISTER_TEST(PartitionFile, TestPartitionFile());
+
+    template <class Store>
+    static void CheckAdjacency(const Store& s, int64_t b, const vector<int>& expect) {
+        AdjacencySpan<int> adj = s.view(b);
+        CHECK_EQ(adj.size(), expect.size());
+        CHECK(std::equal(adj.begin(), adj.end(), expect.begin()));
+        CHECK(s.get(b) == expect);
+    }
+
+    static void TestAdjacencyStore() {
+        typedef AdjacencyStore<vector<int> > Store;
+
+        //shrinking overwrites in place, growing appends
+        Store s;
+        s.resize(3);
+        int a[] = {1, 2, 3, 4, 5};
+        s.set(0, vector<int>(a, a + 3));
+        s.set(2, vector<int>(a + 3, a + 5));
+        CHECK(s.view(1).empty());
+        s.set(0, vector<int>(a, a + 1));
+        CHECK_EQ(s.stored_edges(), 5);
+        s.set(0, vector<int>(a, a + 5));
+        CHECK_EQ(s.stored_edges(), 10);
+        CheckAdjacency(s, 0, vector<int>(a, a + 5));
+        CheckAdjacency(s, 1, vector<int>());
+        CheckAdjacency(s, 2, vector<int>(a + 3, a + 5));
+
+        //lists that keep growing leave dead extents behind; compaction keeps the
+        //array within twice the live edges plus the slack before it kicks in
+        const int slots = 200;
+        vector<vector<int> > lists(slots);
+        s.resize(slots);
+        for (int round = 0; round < 100; ++round) {
+            for (int b = 0; b < slots; ++b) {
+                lists[b].assign((round * 7 + b) % 61, round * slots + b);
+                s.set(b, lists[b]);
+                int64_t live = 0;
+                for (int i = 0; i < slots; ++i) live += lists[i].size();
+                CHECK_LE(s.stored_edges(), 2 * live + 4096 + 61);
+            }
+        }
+        for (int b = 0; b < slots; ++b) {
+            CheckAdjacency(s, b, lists[b]);
+        }
+
+        //adopting built lists appends them after the existing edges
+        Store::Bulk bulk;
+        bulk.add(vector<int>(a, a + 2));
+        bulk.add(vector<int>());
+        bulk.add(vector<int>(a + 2, a + 5));
+        s.resize(slots + 3);
+        int64_t base = s.adopt(bulk);
+        for (int i = 0; i < 3; ++i) {
+            s.set_bulk(slots + i, bulk, i, base);
+        }
+        CheckAdjacency(s, slots, vector<int>(a, a + 2));
+        CheckAdjacency(s, slots + 1, vector<int>());
+        CheckAdjacency(s, slots + 2, vector<int>(a + 2, a + 5));
+        for (int b = 0; b < slots; ++b) {
+            CheckAdjacency(s, b, lists[b]);
+        }
+
+        //mapped edges are used in place until a set() copies them out, after
+        //which the store no longer needs the file
+        string path = StringPrintf("/tmp/adjacency-test.%d", getpid());
+        int k[] = {4, 8, 15};
+        int64_t o[] = {0, 3, 3, 5};
+        int e[] = {16, 23, 42, -1, -2};
+        PartitionFile<int, int>::Write(path, vector<int>(k, k + 3), vector<int64_t>(o, o + 4), vector<int>(e, e + 5));
+        Store m;
+        m.resize(3);
+        {
+            PartitionFile<int, int> part(path);
+            Store::Bulk mapped;
+            mapped.use_mapped(part.file(), part.edges(), part.offsets(), part.vertices());
+            base = m.adopt(mapped);
+            for (int i = 0; i < 3; ++i) {
+                m.set_bulk(i, mapped, i, base);
+            }
+            CHECK_EQ(m.stored_edges(), 5);
+            CHECK(m.view(0).begin() == part.edges());
+            CheckAdjacency(m, 2, vector<int>(e + 3, e + 5));
+        }
+        unlink(path.c_str());
+        m.set(1, vector<int>(a, a + 2));
+        CheckAdjacency(m, 0, vector<int>(e, e + 3));
+        CheckAdjacency(m, 1, vector<int>(a, a + 2));
+        CheckAdjacency(m, 2, vector<int>(e + 3, e + 5));
+        CHECK_EQ(m.stored_edges(), 7);
+    }
+    REGISTER_TEST(AdjacencyStore, TestAdjacencyStore());
 }
@@ -0,0 +1,149 @@
+#ifndef PARTITION_FILE_H_
+#define PARTITION_FILE_H_
+
+#include "util/common.h"
+#include "util/file.h"
+#include "kernel/adjacency.h"
+#include <boost/shared_ptr.hpp>
+
+namespace dsm {
+
+    //Binary CSR form of a text partition file part<N>, written by csrconv to
+    //part<N>.csr. After the header come the vertex ids, the offsets of each
+    //vertex's neighbours in the edge array (one more than there are vertices)
+    //and the edge array itself, each section starting on an 8-byte boundary,
+    //so the file can be mapped and used in place.
+
+    struct PartitionFileHeader {
+        char magic[8];
+        uint32_t key_bytes;
+        uint32_t edge_bytes;
+        int64_t vertices;
+        int64_t edges;
+    };
+
+    static const char kPartitionFileMagic[8] = {'M', 'A', 'I', 'T', 'C', 'S', 'R', '1'};
+
+    static string BinaryPartitionPath(const string& text_path) {
+        return text_path + ".csr";
+    }
+
+    //false when text_path was modified after its binary form was written, so
+    //the binary form may no longer hold the same graph
+    static bool BinaryPartitionCurrent(const string& text_path) {
+        struct stat text, binary;
+        if (stat(text_path.c_str(), &text) != 0) {
+            return true;
+        }
+        PCHECK(stat(BinaryPartitionPath(text_path).c_str(), &binary) == 0) << "; failed to stat "
+                << BinaryPartitionPath(text_path);
+        return binary.st_mtime >= text.st_mtime;
+    }
+
+    template <class K, class T>
+    class PartitionFile {
+    public:
+        PartitionFile(const string& path) : file_(new MappedFile(path)) {
+            CHECK_GE(file_->size(), sizeof (PartitionFileHeader)) << "truncated partition file " << path;
+            const PartitionFileHeader* h = (const PartitionFileHeader*) file_->data();
+            CHECK(memcmp(h->magic, kPartitionFileMagic, sizeof (kPartitionFileMagic)) == 0)
+                    << path << " is not a binary partition file";
+            CHECK_EQ(h->key_bytes, sizeof (K)) << "key size of " << path;
+            CHECK_EQ(h->edge_bytes, sizeof (T)) << "edge size of " << path;
+            CHECK_EQ(file_->size(), bytes(h->vertices, h->edges)) << "truncated partition file " << path;
+
+            vertices_ = h->vertices;
+            keys_ = (const K*) (file_->data() + sizeof (PartitionFileHeader));
+            offsets_ = (const int64_t*) ((const char*) keys_ + align(vertices_ * sizeof (K)));
+            edges_ = (const T*) (offsets_ + vertices_ + 1);
+        }
+
+        int64_t vertices() const {
+            return vertices_;
+        }
+
+        int64_t num_edges() const {
+            return offsets_[vertices_];
+        }
+
+        const K& key(int64_t i) const {
+            return keys_[i];
+        }
+
+        //vertices() + 1 of them
+        const int64_t* offsets() const {
+            return offsets_;
+        }
+
+        AdjacencySpan<T> adjacency(int64_t i) const {
+            return AdjacencySpan<T>(edges_ + offsets_[i], edges_ + offsets_[i + 1]);
+        }
+
+        const T* edges() const {
+            return edges_;
+        }
+
+        //the mapping; the edge array stays valid as long as a copy is held
+        boost::shared_ptr<MappedFile> file() const {
+            return file_;
+        }
+
+        //offsets holds vertices + 1 entries, the last one the number of edges
+        static void Write(const string& path, const std::vector<K>& keys, const std::vector<int64_t>& offsets,
+                const std::vector<T>& edges) {
+            CHECK_EQ(offsets.size(), keys.size() + 1);
+            CHECK_EQ(offsets.back(), edges.size());
+
+            PartitionFileHeader h;
+            memcpy(h.magic, kPartitionFileMagic, sizeof (kPartitionFileMagic));
+            h.key_bytes = sizeof (K);
+            h.edge_bytes = sizeof (T);
+            h.vertices = keys.size();
+            h.edges = edges.size();
+
+            //written under a temporary name, so a reader never maps half a file
+            string tmp = path + ".tmp";
+            {
+                LocalFile f(tmp, "w");
+                static const char zeros[8] = {0};
+                f.write((const char*) &h, sizeof (h));
+                write_section(&f, keys);
+                f.write(zeros, align(keys.size() * sizeof (K)) - keys.size() * sizeof (K));
+                write_section(&f, offsets);
+                write_section(&f, edges);
+            }
+            File::Move(tmp, path);
+        }
+
+    private:
+        static int64_t align(int64_t n) {
+            return (n + 7) & ~7LL;
+        }
+
+        static int64_t bytes(int64_t vertices, int64_t edges) {
+            return sizeof (PartitionFileHeader) + align(vertices * sizeof (K)) + (vertices + 1) * sizeof (int64_t)
+                    + edges * sizeof (T);
+        }
+
+        //in pieces, File::write takes an int length
+        template <class E>
+        static void write_section(LocalFile* f, const std::vector<E>& v) {
+            const char* p = v.empty() ? NULL : (const char*) &v[0];
+            int64_t left = v.size() * sizeof (E);
+            while (left > 0) {
+                int n = std::min(left, (int64_t) 1 << 30);
+                PCHECK(f->write(p, n) == n) << "; failed to write " << f->name();
+                p += n;
+                left -= n;
+            }
+        }
+
+        boost::shared_ptr<MappedFile> file_;
+        int64_t vertices_;
+        const K* keys_;
+        const int64_t* offsets_;
+        const T* edges_;
+    };
+}
+
+#endif /* PARTITION_FILE_H_ */
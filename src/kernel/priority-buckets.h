@@ -0,0 +1,115 @@
+#ifndef PRIORITY_BUCKETS_H_
+#define PRIORITY_BUCKETS_H_
+
+#include "util/common.h"
+#include <string.h>
+
+namespace dsm {
+
+    //StateTable slots grouped by the sign and binary exponent of their priority,
+    //so a scheduled batch is taken from the top buckets in O(batch) rather than
+    //by sampling a threshold and scanning the table. The buckets rank priorities
+    //as numbers: negative ones below zero and positive ones above it, with NaN
+    //lowest, so kernels whose priorities are never positive are scheduled too.
+    //The table pushes a slot when it moves to another bucket and keeps no
+    //per-slot state here: an entry is stale once the slot belongs in another
+    //bucket, or in none (kNone, a slot without a pending delta), and stale
+    //entries are dropped when popped.
+
+    class PriorityBuckets {
+    public:
+        //NaN, then negative priorities, zero and positive ones, one bucket per
+        //exponent from 2^-63 to 2^63; larger and smaller magnitudes share the
+        //end buckets of their sign
+        static const int kBuckets = 256;
+        static const int kZero = kBuckets / 2;
+        static const int kNone = -1;
+
+        PriorityBuckets() : top_(kNone), pending_(0), slots_(0) {
+        }
+
+        template <class V>
+        static int bucket(const V& priority) {
+            double p = static_cast<double> (priority);
+            if (p != p) return 0;
+            if (p == 0) return kZero;
+
+            //read the exponent from the bits, ilogb() is a call
+            uint64_t bits;
+            memcpy(&bits, &p, sizeof(bits));
+            int e = (int) ((bits >> 52) & 0x7ff) - 1023;
+            int rank = std::min(std::max(e + 63, 0), kZero - 2);
+            return p > 0 ? kZero + 1 + rank : kZero - 1 - rank;
+        }
+
+        void resize(int64_t slots) {
+            slots_ = slots;
+        }
+
+        void push(int slot, int b) {
+            if (b == kNone) return;
+
+            buckets_[b].push_back(slot);
+            top_ = std::max(top_, b);
+            ++pending_;
+        }
+
+        //moves about n queued slots to out, highest priority first; current(slot)
+        //gives the bucket a slot belongs in now. The top bucket is always taken
+        //whole, its slots are not ranked any further. out comes back sorted and
+        //without duplicates.
+        template <class Current>
+        void pop(int64_t n, const Current& current, std::vector<int>* out) {
+            bool first = true;
+            while (top_ != kNone && (first || (int64_t) out->size() < n)) {
+                std::vector<int>& q = buckets_[top_];
+                while (!q.empty() && (first || (int64_t) out->size() < n)) {
+                    int slot = q.back();
+                    q.pop_back();
+                    --pending_;
+                    if (current(slot) == top_) out->push_back(slot);
+                }
+                if (q.empty()) --top_;
+                first = out->empty();
+            }
+
+            //a slot that left a bucket and came back is in it twice
+            std::sort(out->begin(), out->end());
+            out->erase(std::unique(out->begin(), out->end()), out->end());
+
+            if (pending_ > 2 * slots_ + 1024) compact(current);
+        }
+
+        void clear() {
+            for (int b = 0; b < kBuckets; ++b) {
+                buckets_[b].clear();
+            }
+            top_ = kNone;
+            pending_ = 0;
+        }
+
+    private:
+
+        //drop the stale entries once they outnumber the slots
+        template <class Current>
+        void compact(const Current& current) {
+            pending_ = 0;
+            for (int b = 0; b < kBuckets; ++b) {
+                std::vector<int>& q = buckets_[b];
+                int live = 0;
+                for (size_t i = 0; i < q.size(); ++i) {
+                    if (current(q[i]) == b) q[live++] = q[i];
+                }
+                q.resize(live);
+                pending_ += live;
+            }
+        }
+
+        std::vector<int> buckets_[kBuckets];
+        int top_;
+        int64_t pending_;
+        int64_t slots_;
+    };
+}
+
+#endif /* PRIORITY_BUCKETS_H_ */
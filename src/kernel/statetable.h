@@ -5,74 +5,83 @@
 #include "worker/worker.pb.h"
 #include "kernel/table.h"
 #include "kernel/local-table.h"
+#include "kernel/adjacency.h"
+#include "kernel/hash-index.h"
+#include "kernel/priority-buckets.h"
 #include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
 #include <boost/random/mersenne_twister.hpp>
 #include <boost/random/uniform_int.hpp>
 #include <boost/random/lognormal_distribution.hpp>
 #include <boost/random/variate_generator.hpp>
 #include <algorithm>
 
+DECLARE_int32(kernel_threads);
+
 namespace dsm {
 
     static const int sample_size = 1000;
 
+    //an idle pass waits for remote updates this long at a time (seconds), and
+    //falls back to a pass over the entire table after kIdlePassTimeout of it
+    static const double kIdleWait = 1;
+    static const double kIdlePassTimeout = 10;
+
+    //Maps a key to its slot in a dense StateTable. Under Sharding::Mod every key
+    //a shard owns is shard + i * num_shards, so key / num_shards is a unique slot.
+    //Only integral keys have one.
+    template <class K>
+    struct DenseIndex {
+        static const bool supported = false;
+
+        static int64_t slot(const K& k, int shards) {
+            LOG(FATAL) << "dense StateTable is only supported for integral keys";
+            return -1;
+        }
+    };
+
+    template <>
+    struct DenseIndex<int> {
+        static const bool supported = true;
+
+        static int64_t slot(const int& k, int shards) {
+            return k / shards;
+        }
+    };
+
+    template <>
+    struct DenseIndex<uint32_t> {
+        static const bool supported = true;
+
+        static int64_t slot(const uint32_t& k, int shards) {
+            return k / shards;
+        }
+    };
+
     template <class K, class V1, class V2, class V3>
     struct ClutterRecord;
 
-    template <class K, class V1, class V2, class V3>
+    //IK is the static type of the table's iterate kernel: a concrete kernel
+    //gets accumulate and priority bound at compile time in the update loops
+    template <class K, class V1, class V2, class V3, class IK = IterateKernel<K, V1, V3> >
     class StateTable :
     public LocalTable,
     public TypedTable<K, V1, V2, V3>,
     private boost::noncopyable { //1
-    private:
-#pragma pack(push, 1)
-
-        struct Bucket {
-            K k;
-            V1 v1;
-            V2 v2;
-            V3 v3;
-            V1 priority;
-            bool in_use;
-            bool is_copy;
-        };
-#pragma pack(pop)
-
     public:
         typedef FileDecodeIterator<K, V1, V2, V3> FileUpdateDecoder;
         typedef NetDecodeIterator<K, V1> NetUpdateDecoder;
 
         struct Iterator : public TypedTableIterator<K, V1, V2, V3> {//2
 
-            Iterator(StateTable<K, V1, V2, V3>& parent, bool bfilter) : pos(-1), parent_(parent) {
+            Iterator(StateTable<K, V1, V2, V3, IK>& parent, bool bfilter) : pos(-1), parent_(parent) {
                 pos = -1; //pos(-1) doesn't work
-                /*
-                 this filter is very important in large-scale experiment, if there is no such control,
-                 * many useless parsing will occur.,degrading the performance a lot
-             
-                 */
-                if (bfilter) {
-                    //check if there is a change
-                    b_no_change = true;
-
-                    //random number generator
-                    boost::mt19937 gen(time(0));
-                    boost::uniform_int<> dist(0, parent_.buckets_.size() - 1);
-                    boost::variate_generator<boost::mt19937&, boost::uniform_int<> > rand_num(gen, dist);
-
-                    defaultv = ((IterateKernel<K, V1, V3>*)parent_.info_.iterkernel)->default_v();
-                    int i;
-                    for (i = 0; i < sample_size && b_no_change; i++) {
-                        int rand_pos = rand_num();
-                        while (!parent_.buckets_[rand_pos].in_use) {
-                            rand_pos = rand_num();
-                        }
 
-                        b_no_change = b_no_change && parent_.buckets_[rand_pos].v1 != defaultv;
-                    }
-                } else {
-                    b_no_change = false;
-                }
+                //a pass visits only the slots a delta reached since their last
+                //visit, so converged parts of the graph cost nothing
+                defaultv = ((IterateKernel<K, V1, V3>*)parent_.info_.iterkernel)->default_v();
+                parent_.take_active(&active_pos);
+                b_no_change = bfilter && active_pos.empty();
 
                 //Next();
             }
@@ -97,140 +106,93 @@ namespace dsm {
             }
 
             bool Next() {
+                //skip removed slots, and slots whose delta was already spread by
+                //an earlier visit in this pass
                 do {
                     ++pos;
-                    //cout << "pos now is " << pos << " v1 " << parent_.buckets_[pos].v1 << endl;
-                } while (pos < parent_.size_ && (/*parent_.buckets_[pos].v1 == defaultv || */!parent_.buckets_[pos].in_use));
+                } while (pos < (int) active_pos.size() && (!parent_.in_use(active_pos[pos])
+                        || parent_.v1_[active_pos[pos]] == defaultv));
 
-                if (pos >= parent_.size_) {
-                    return false;
-                } else {
-                    return true;
-                }
+                return pos < (int) active_pos.size();
             }
 
             bool done() {
-                //cout<< "pos " << pos << "\tsize" << parent_.size_ << endl;
-                return pos + 1 == parent_.size_;
+                return pos + 1 >= (int) active_pos.size();
             }
 
             const K& key() {
-                return parent_.buckets_[pos].k;
+                return parent_.keys_[active_pos[pos]];
             }
 
             V1& value1() {
-                return parent_.buckets_[pos].v1;
+                return parent_.v1_[active_pos[pos]];
             }
 
             V2& value2() {
-                return parent_.buckets_[pos].v2;
+                return parent_.v2_[active_pos[pos]];
+            }
+
+            V3 value3() {
+                return parent_.adj_.get(active_pos[pos]);
             }
 
-            V3& value3() {
-                return parent_.buckets_[pos].v3;
+            typename AdjacencyStore<V3>::ViewRef adjacency() {
+                return parent_.adj_.view(active_pos[pos]);
             }
 
             bool is_copy() {
-                return parent_.buckets_[pos].is_copy;
+                return parent_.is_copy(active_pos[pos]);
             }
 
             int pos;
-            StateTable<K, V1, V2, V3> &parent_;
+            StateTable<K, V1, V2, V3, IK> &parent_;
+            vector<int> active_pos;
             bool b_no_change;
             V1 defaultv;
         }; //2
 
         struct ScheduledIterator : public TypedTableIterator<K, V1, V2, V3> {//3
 
-            ScheduledIterator(StateTable<K, V1, V2, V3>& parent, bool bfilter) : pos(-1), parent_(parent) {
+            ScheduledIterator(StateTable<K, V1, V2, V3, IK>& parent, bool bfilter) : pos(-1), parent_(parent) {
 
                 pos = -1;
-                b_no_change = true;
-
-                //random number generator
-                boost::mt19937 gen(time(0));
-                boost::uniform_int<> dist(0, parent_.buckets_.size() - 1);
-                boost::variate_generator<boost::mt19937&, boost::uniform_int<> > rand_num(gen, dist);
-
-                V1 defaultv = ((IterateKernel<K, V1, V3>*)parent_.info_.iterkernel)->default_v();
 
+                const V1& defaultv = parent_.defaultv_;
                 if (parent_.entries_ <= sample_size) {
-                    //if table size is less than the sample set size, schedule them all
-                    int i;
-                    for (i = 0; i < parent_.size_; i++) {
-                        if (parent_.buckets_[i].in_use) {
+                    //small tables are scheduled whole: every slot with a pending
+                    //delta, whatever its priority, which empties the buckets
+                    parent_.schedule_.clear();
+                    for (int i = 0; i < parent_.size_; i++) {
+                        if (parent_.in_use(i) && parent_.v1_[i] != defaultv) {
                             scheduled_pos.push_back(i);
-                            b_no_change = b_no_change && parent_.buckets_[i].v1 != defaultv;
                         }
                     }
-                    if (b_no_change && bfilter) return;
-                    if (!bfilter) b_no_change = false;
                 } else {
-                    //sample random pos, the sample reflect the whole data set more or less
-                    vector<int> sampled_pos;
-                    int i;
-                    int trials = 0;
-                    for (i = 0; i < sample_size; i++) {
-                        int rand_pos = rand_num();
-                        trials++;
-                        while (!parent_.buckets_[rand_pos].in_use) {
-                            rand_pos = rand_num();
-                            trials++;
-                        }
-                        sampled_pos.push_back(rand_pos);
-
-                        b_no_change = b_no_change && parent_.buckets_[rand_pos].v1 == defaultv;
-                    }
-
-                    if (b_no_change && bfilter) return;
-                    if (!bfilter) b_no_change = false;
-
-                    /*
-                    //determine priority
-                    for(i=0; i<parent_.size_; i++){
-                        if(parent_.buckets_[i].v1 == defaultv) continue;
-                        V sum = ((IterateKernel<V1>*)parent.info_.iterkernel)->accumulate(&parent_.buckets_[i].v1, parent_.buckets_[i].v2);
-                        parent_.buckets_[i].priority = abs(sum - parent_.buckets_[i].v2);
-                    }
-                     */
-
-                    //get the cut index, everything larger than the cut will be scheduled
-                    sort(sampled_pos.begin(), sampled_pos.end(), compare_priority(parent_));
-                    int cut_index = sample_size * parent_.info_.schedule_portion;
-                    V1 threshold = parent_.buckets_[sampled_pos[cut_index]].priority;
-                    //V1 threshold = ((Scheduler<K, V1>*)parent_.info_.scheduler)->priority(parent_.buckets_[sampled_pos[cut_index]].k, parent_.buckets_[sampled_pos[cut_index]].v1);
-
-                    VLOG(1) << "cut index " << cut_index << " theshold " << threshold << " pos " << sampled_pos[cut_index] << " max " << parent_.buckets_[sampled_pos[0]].v1;
-
-                    if (cut_index == 0 || parent_.buckets_[sampled_pos[0]].priority == threshold) {
-                        //to avoid non eligible records
-                        int i;
-                        for (i = 0; i < parent_.size_; i++) {
-                            if (!parent_.buckets_[i].in_use) continue;
-                            if (parent_.buckets_[i].v1 == defaultv) continue;
-
-                            if (parent_.buckets_[i].priority >= threshold) {
-                                scheduled_pos.push_back(i);
-                            }
-                        }
-                    } else {
-                        int i;
-                        for (i = 0; i < parent_.size_; i++) {
-                            if (!parent_.buckets_[i].in_use) continue;
-                            if (parent_.buckets_[i].v1 == defaultv) continue;
-
-                            if (parent_.buckets_[i].priority > threshold) {
-                                scheduled_pos.push_back(i);
-                            }
+                    //otherwise the top portion by priority
+                    int64_t batch = std::max((int64_t) (parent_.entries_ * parent_.info_.schedule_portion), (int64_t) 1);
+                    parent_.schedule_.pop(batch, CurrentBucket(parent_), &scheduled_pos);
+                    int n = 0;
+                    for (int i = 0; i < scheduled_pos.size(); i++) {
+                        if (parent_.in_use(scheduled_pos[i]) && parent_.v1_[scheduled_pos[i]] != defaultv) {
+                            scheduled_pos[n++] = scheduled_pos[i];
                         }
                     }
+                    scheduled_pos.resize(n);
                 }
 
-                VLOG(1) << "table size " << parent_.buckets_.size() << " workerid " << parent_.id() << " scheduled " << scheduled_pos.size();
+                b_no_change = bfilter && scheduled_pos.empty();
+
+                VLOG(1) << "table size " << parent_.size_ << " workerid " << parent_.id() << " scheduled " << scheduled_pos.size();
                 //Next();
             }
 
+            //slots popped for this batch but not visited, e.g. when an idle pass
+            //drops the batch, go back into the buckets or they would never be
+            //scheduled again
             virtual ~ScheduledIterator() {
+                for (int i = pos + 1; i < (int) scheduled_pos.size(); i++) {
+                    parent_.reschedule(scheduled_pos[i]);
+                }
             }
 
             Marshal<K>* kmarshal() {
@@ -259,41 +221,31 @@ namespace dsm {
             }
 
             const K& key() {
-                return parent_.buckets_[scheduled_pos[pos]].k;
+                return parent_.keys_[scheduled_pos[pos]];
             }
 
             V1& value1() {
-                return parent_.buckets_[scheduled_pos[pos]].v1;
+                return parent_.v1_[scheduled_pos[pos]];
             }
 
             V2& value2() {
-                return parent_.buckets_[scheduled_pos[pos]].v2;
+                return parent_.v2_[scheduled_pos[pos]];
             }
 
-            V3& value3() {
-                return parent_.buckets_[scheduled_pos[pos]].v3;
+            V3 value3() {
+                return parent_.adj_.get(scheduled_pos[pos]);
             }
 
-            bool is_copy() {
-                return parent_.buckets_[scheduled_pos[pos]].is_copy;
+            typename AdjacencyStore<V3>::ViewRef adjacency() {
+                return parent_.adj_.view(scheduled_pos[pos]);
             }
 
-            class compare_priority {
-            public:
-                StateTable<K, V1, V2, V3> &parent;
-
-                compare_priority(StateTable<K, V1, V2, V3> &inparent) : parent(inparent) {
-                }
-
-                bool operator()(const int a, const int b) {
-                    return parent.buckets_[a].priority > parent.buckets_[b].priority;
-                    //return ((Accumulator<V1>*)parent.info_.accum)->priority(parent.buckets_[a].v1, parent.buckets_[a].v2)
-                    //> ((Accumulator<V1>*)parent.info_.accum)->priority(parent.buckets_[b].v1, parent.buckets_[b].v2);
-                }
-            };
+            bool is_copy() {
+                return parent_.is_copy(scheduled_pos[pos]);
+            }
 
             int pos;
-            StateTable<K, V1, V2, V3> &parent_;
+            StateTable<K, V1, V2, V3, IK> &parent_;
             double portion;
             vector<int> scheduled_pos;
             bool b_no_change;
@@ -303,7 +255,7 @@ namespace dsm {
 
         struct EntirePassIterator : public TypedTableIterator<K, V1, V2, V3>, public LocalTableIterator<K, V2> {//4
 
-            EntirePassIterator(StateTable<K, V1, V2, V3>& parent) : pos(-1), parent_(parent) {
+            EntirePassIterator(StateTable<K, V1, V2, V3, IK>& parent) : pos(-1), parent_(parent) {
                 //Next();
                 total = 0;
                 pos = -1;
@@ -332,7 +284,7 @@ namespace dsm {
             bool Next() {
                 do {
                     ++pos;
-                } while (pos < parent_.size_ && !parent_.buckets_[pos].in_use);
+                } while (pos < parent_.size_ && !parent_.in_use(pos));
                 total++;
 
                 if (pos >= parent_.size_) {
@@ -352,27 +304,31 @@ namespace dsm {
             }
 
             const K& key() {
-                return parent_.buckets_[pos].k;
+                return parent_.keys_[pos];
             }
 
             V1& value1() {
-                return parent_.buckets_[pos].v1;
+                return parent_.v1_[pos];
             }
 
             V2& value2() {
-                return parent_.buckets_[pos].v2;
+                return parent_.v2_[pos];
+            }
+
+            V3 value3() {
+                return parent_.adj_.get(pos);
             }
 
-            V3& value3() {
-                return parent_.buckets_[pos].v3;
+            typename AdjacencyStore<V3>::ViewRef adjacency() {
+                return parent_.adj_.view(pos);
             }
 
             bool is_copy() {
-                return parent_.buckets_[pos].is_copy;
+                return parent_.is_copy(pos);
             }
 
             int pos;
-            StateTable<K, V1, V2, V3> &parent_;
+            StateTable<K, V1, V2, V3, IK> &parent_;
             int total;
             V1 defaultv;
         }; //4
@@ -380,18 +336,32 @@ namespace dsm {
         struct Factory : public TableFactory {
 
             TableBase* New() {
-                return new StateTable<K, V1, V2, V3>();
+                return new StateTable<K, V1, V2, V3, IK>();
+            }
+        };
+
+        //slots are addressed by DenseIndex<K>::slot() instead of hashing,
+        //only valid for integral keys sharded with Sharding::Mod
+        struct DenseFactory : public TableFactory {
+
+            TableBase* New() {
+                return new StateTable<K, V1, V2, V3, IK>(1, true);
             }
         };
 
         // Construct a StateTable with the given initial size; it will be expanded as necessary.
-        StateTable(int size = 1);
+        StateTable(int size = 1, bool dense = false);
 
         ~StateTable() {
         }
 
         void Init(const TableDescriptor* td) {
             TableBase::Init(td);
+            if (info_.iterkernel) {
+                defaultv_ = ((IterateKernel<K, V1, V3>*)info_.iterkernel)->default_v();
+            }
+            prioritized_ = info_.schedule_portion < 1;
+            striped_ = FLAGS_kernel_threads > 1;
         }
 
         V1 getF1(const K& k);
@@ -402,23 +372,32 @@ namespace dsm {
         void putc(const K &k, const V1 &v1, V3 &v3, int shard);
         void put(const K& k, const V1& v1, const V2& v2, const V3& v3);
         void put2(const K &k, const V1 &v1, const V2 &v2, const V3 &v3);
+        //puts keys[i] with v1s[i], v2s[i] and the i-th list of adjacency for
+        //every i, growing the table at most once; the lists are taken over
+        //from adjacency, not copied
+        void bulk_build(const std::vector<K>& keys, const std::vector<V1>& v1s, const std::vector<V2>& v2s,
+                typename AdjacencyStore<V3>::Bulk& adjacency);
         void setCopy(const K&k);
         void setNoCopy(const K&k);
         void updateF1(const K& k, const V1& v);
+        V1 takeF1(const K& k, const V1& v);
         void updateF2(const K& k, const V2& v);
         void updateF3(const K& k, const V3& v);
         void accumulateFFF(const K &k, const V1 &v, int shard);
         void accumulateFF(const K &k, const V1 &v, int shard);
         void accumulateF1(const K& k, const V1& v);
+        void accumulateF1Batch(const pair<K, V1>* begin, const pair<K, V1>* end);
         void accumulateF2(const K& k, const V2& v);
         void accumulateF3(const K& k, const V3& v);
 
-        bool remove(const K& k) {
-            LOG(FATAL) << "Not implemented.";
-            return false;
-        }
+        bool remove(const K& k);
 
         void resize(int64_t size);
+        //room for n entries in all, so putting them never grows the table; a
+        //dense table is sized for keys up to slot n
+        void reserve(int64_t n) {
+            resize(n);
+        }
 
         bool empty() {
             return size() == 0;
@@ -429,9 +408,14 @@ namespace dsm {
         }
 
         void clear() {
-            for (int i = 0; i < size_; ++i) {
-                buckets_[i].in_use = 0;
-            }
+            std::fill(in_use_.begin(), in_use_.end(), 0);
+            std::fill(is_copy_.begin(), is_copy_.end(), 0);
+            index_.clear();
+            free_slots_.clear();
+            schedule_.clear();
+            std::fill(active_.begin(), active_.end(), 0);
+            worklist_.clear();
+            used_ = 0;
             entries_ = 0;
         }
 
@@ -439,32 +423,29 @@ namespace dsm {
         }
 
         bool compare_priority(int i, int j) {
-            return buckets_[i].priority > buckets_[j].priority;
-            //return ((Scheduler<K, V1>*)info_.scheduler)->priority(buckets_[i].k, buckets_[i].v1)
-            //> ((Scheduler<K, V1>*)info_.scheduler)->priority(buckets_[j].k, buckets_[j].v1);
+            return priority_[i] > priority_[j];
+            //return ((Scheduler<K, V1>*)info_.scheduler)->priority(keys_[i], v1_[i])
+            //> ((Scheduler<K, V1>*)info_.scheduler)->priority(keys_[j], v1_[j]);
         }
 
         TableIterator *get_iterator(TableHelper* helper, bool bfilter) {
             if (terminated_) return NULL; //if get term signal, return null to tell program terminate
             helper->FlushUpdates();
-            boost::this_thread::sleep(boost::posix_time::seconds(0.1));
             helper->HandlePutRequest();
 
             Iterator* iter = new Iterator(*this, true);
-            int trial = 0;
+            Timer idle;
             while (iter->b_no_change) {
                 VLOG(1) << "wait for put";
                 delete iter;
                 helper->FlushUpdates();
-                boost::this_thread::sleep(boost::posix_time::seconds(1));
-                helper->HandlePutRequest();
+                helper->WaitForUpdates(kIdleWait);
 
                 if (terminated_) return NULL; //if get term signal, return null to tell program terminate
 
                 iter = new Iterator(*this, bfilter);
 
-                trial++;
-                if (trial >= 10) {
+                if (idle.elapsed() >= kIdlePassTimeout) {
                     delete iter;
                     EntirePassIterator* entireIter = new EntirePassIterator(*this);
 
@@ -490,30 +471,27 @@ namespace dsm {
         TableIterator *schedule_iterator(TableHelper* helper, bool bfilter) {
             if (terminated_) return NULL;
             helper->FlushUpdates();
-            boost::this_thread::sleep(boost::posix_time::seconds(0.1));
             helper->HandlePutRequest();
 
             ScheduledIterator* iter = new ScheduledIterator(*this, bfilter);
-            int trial = 0;
+            Timer idle;
             while (iter->b_no_change) {
                 VLOG(1) << "wait for put, send buffered updates";
                 delete iter;
                 helper->FlushUpdates();
-                boost::this_thread::sleep(boost::posix_time::seconds(1));
-                helper->HandlePutRequest();
+                helper->WaitForUpdates(kIdleWait);
 
                 if (terminated_) return NULL; //if get term signal, return null to tell program terminate
 
                 iter = new ScheduledIterator(*this, bfilter);
 
-                trial++;
-                if (trial >= 10) {
+                if (idle.elapsed() >= kIdlePassTimeout) {
                     delete iter;
                     EntirePassIterator* entireIter = new EntirePassIterator(*this);
 
                     total_curr = 0;
                     while (!entireIter->done()) {
-                        entireIter->Next();
+                        if (!entireIter->Next()) break;
                         total_curr += entireIter->value2();
                     }
 
@@ -556,54 +534,198 @@ namespace dsm {
 
     private:
 
-        uint32_t bucket_idx(K k) {
-            return hashobj_(k) % size_;
+        //in a dense table the slot is computed, not searched for; a slot no key
+        //was put into is -1, as a key missing from the hash index is
+        int bucket_for_key(const K& k) {
+            if (dense_) {
+                int64_t b = DenseIndex<K>::slot(k, info_.num_shards);
+                return (uint64_t) b < (uint64_t) size_ && in_use(b) ? b : -1;
+            }
+
+            return index_.find(k);
         }
 
-        int bucket_for_key(const K& k) {
-            int start = bucket_idx(k);
-            int b = start;
+        int insert_slot(const K& k);
+        int put_slot(const K& k);
+        void put_values(int b, const V1& v1, const V2& v2);
 
-            do {
-                if (buckets_[b].in_use) {
-                    if (buckets_[b].k == k) {
-                        return b;
+        bool in_use(int64_t b) const {
+            return (in_use_[b >> 6] >> (b & 63)) & 1;
+        }
+
+        bool is_copy(int64_t b) const {
+            return (is_copy_[b >> 6] >> (b & 63)) & 1;
+        }
+
+        static void set_bit(std::vector<uint64_t>& bits, int64_t b, bool on) {
+            if (on) {
+                bits[b >> 6] |= (uint64_t) 1 << (b & 63);
+            } else {
+                bits[b >> 6] &= ~((uint64_t) 1 << (b & 63));
+            }
+        }
+
+        void activate(int b) {
+            uint64_t& word = active_[b >> 6];
+            uint64_t bit = (uint64_t) 1 << (b & 63);
+            if (word & bit) return;
+
+            if (striped_) {
+                //the word is shared with slots of other stripes
+                if (__sync_fetch_and_or(&word, bit) & bit) return;
+                boost::mutex::scoped_lock sl(list_lock_);
+                worklist_.push_back(b);
+            } else {
+                word |= bit;
+                worklist_.push_back(b);
+            }
+        }
+
+        //the bucket slot b belongs in: none without a pending delta
+        int current_bucket(int b) const {
+            return v1_[b] == defaultv_ ? PriorityBuckets::kNone : PriorityBuckets::bucket(priority_[b]);
+        }
+
+        void reschedule(int b) {
+            int bucket = current_bucket(b);
+            if (striped_) {
+                boost::mutex::scoped_lock ll(list_lock_);
+                schedule_.push(b, bucket);
+            } else {
+                schedule_.push(b, bucket);
+            }
+        }
+
+        void accumulate_slot(int b, const V1& v) {
+            SlotLock sl(*this, b);
+            IK* kernel = (IK*) info_.iterkernel;
+            if (prioritized_) {
+                //a slot whose delta was taken is in no bucket, so the first
+                //delta after that always queues it
+                int before = current_bucket(b);
+                KernelCalls<IK>::accumulate(kernel, v1_[b], v);
+                KernelCalls<IK>::priority(kernel, priority_[b], v2_[b], v1_[b]);
+                int after = current_bucket(b);
+                if (after != before) {
+                    if (striped_) {
+                        boost::mutex::scoped_lock ll(list_lock_);
+                        schedule_.push(b, after);
+                    } else {
+                        schedule_.push(b, after);
                     }
-                } else {
-                    return -1;
                 }
+                return;
+            }
+            KernelCalls<IK>::accumulate(kernel, v1_[b], v);
+            KernelCalls<IK>::priority(kernel, priority_[b], v2_[b], v1_[b]);
+            activate(b);
+        }
 
-                b = (b + 1) % size_;
-            } while (b != start);
+        //takes the lock guarding slot b when several kernel threads share the
+        //table, none otherwise
+        struct SlotLock {
+            SlotLock(StateTable<K, V1, V2, V3, IK>& t, int b) : m(t.striped_ ? &t.stripes_[b & (kLockStripes - 1)] : NULL) {
+                if (m) m->lock();
+            }
 
-            return -1;
+            ~SlotLock() {
+                if (m) m->unlock();
+            }
+
+            boost::mutex* m;
+        };
+
+        //moves the active slots to out in slot order and empties the set
+        void take_active(std::vector<int>* out) {
+            out->clear();
+            if ((int64_t) worklist_.size() * 8 > size_) {
+                //most of the table, reading the bitmap is cheaper than sorting
+                out->reserve(worklist_.size());
+                for (size_t w = 0; w < active_.size(); ++w) {
+                    for (uint64_t bits = active_[w]; bits != 0; bits &= bits - 1) {
+                        out->push_back(w * 64 + __builtin_ctzll(bits));
+                    }
+                    active_[w] = 0;
+                }
+                worklist_.clear();
+            } else {
+                out->swap(worklist_);
+                std::sort(out->begin(), out->end());
+                for (size_t i = 0; i < out->size(); ++i) {
+                    set_bit(active_, (*out)[i], false);
+                }
+            }
         }
 
-        std::vector<Bucket> buckets_;
+        //one column per field (structure of arrays), so the scan and accumulate
+        //paths only pull in the columns they touch, never the V3 adjacency;
+        //occupancy and copy flags are bitmaps, one bit per slot. A key keeps
+        //its slot until it is removed, the index only maps keys to slots.
+        std::vector<K> keys_;
+        std::vector<V1> v1_;
+        std::vector<V2> v2_;
+        AdjacencyStore<V3> adj_;
+        std::vector<V1> priority_;
+        std::vector<uint64_t> in_use_;
+        std::vector<uint64_t> is_copy_;
+
+        HashIndex<K> index_;
+        std::vector<int> free_slots_; //slots released by remove()
+        int64_t used_; //slots handed out so far, hash mode only
+
+        struct CurrentBucket {
+            const StateTable<K, V1, V2, V3, IK>& table;
+
+            CurrentBucket(const StateTable<K, V1, V2, V3, IK>& t) : table(t) {
+            }
+
+            int operator()(int slot) const {
+                return table.current_bucket(slot);
+            }
+        };
+
+        //slots with a pending delta by priority, kept only when scheduling a portion
+        PriorityBuckets schedule_;
+        bool prioritized_;
+        V1 defaultv_;
+
+        //slots a delta reached since the last pass took them, kept otherwise:
+        //the bitmap dedups the worklist
+        std::vector<uint64_t> active_;
+        std::vector<int> worklist_;
+
+        //with --kernel_threads > 1 a slot's delta, value and priority are guarded
+        //by one of kLockStripes locks, and the worklist and buckets by list_lock_
+        static const int kLockStripes = 256;
+        bool striped_;
+        boost::mutex stripes_[kLockStripes];
+        boost::mutex list_lock_;
+
+        std::vector<int> batch_slots_; //accumulateF1Batch scratch, kernel thread only
 
         int64_t entries_;
         int64_t size_;
         double total_curr;
         int64_t total_updates;
-
-        std::tr1::hash<K> hashobj_;
+        bool dense_;
 
     }; //1
 
-    template <class K, class V1, class V2, class V3>
-    StateTable<K, V1, V2, V3>::StateTable(int size)
-    : buckets_(0), entries_(0), size_(0), total_curr(0), total_updates(0) {
+    template <class K, class V1, class V2, class V3, class IK>
+    StateTable<K, V1, V2, V3, IK>::StateTable(int size, bool dense)
+    : used_(0), prioritized_(false), defaultv_(), striped_(false), entries_(0), size_(0), total_curr(0), total_updates(0), dense_(dense) {
         clear();
 
-        VLOG(1) << "new statetable size " << size;
+        VLOG(1) << "new " << (dense ? "dense " : "") << "statetable size " << size;
         resize(size);
     }
 
-    template <class K, class V1, class V2, class V3>
-    void StateTable<K, V1, V2, V3>::serializeToFile(TableCoder *out) {
-        Iterator *i = (Iterator*) get_iterator(NULL, false);
+    template <class K, class V1, class V2, class V3, class IK>
+    void StateTable<K, V1, V2, V3, IK>::serializeToFile(TableCoder *out) {
+        EntirePassIterator *i = new EntirePassIterator(*this);
         string k, v1, v2, v3;
         while (!i->done()) {
+            if (!i->Next()) break;
             k.clear();
             v1.clear();
             v2.clear();
@@ -613,29 +735,28 @@ namespace dsm {
             ((Marshal<V2>*)info_.value2_marshal)->marshal(i->value2(), &v2);
             ((Marshal<V3>*)info_.value3_marshal)->marshal(i->value3(), &v3);
             out->WriteEntryToFile(k, v1, v2, v3);
-            i->Next();
         }
         delete i;
     }
 
-    template <class K, class V1, class V2, class V3>
-    void StateTable<K, V1, V2, V3>::serializeToNet(KVPairCoder *out) {
-        Iterator *i = (Iterator*) get_iterator(NULL, false);
+    template <class K, class V1, class V2, class V3, class IK>
+    void StateTable<K, V1, V2, V3, IK>::serializeToNet(KVPairCoder *out) {
+        EntirePassIterator *i = new EntirePassIterator(*this);
         string k, v1;
         while (!i->done()) {
+            if (!i->Next()) break;
             k.clear();
             v1.clear();
             ;
             ((Marshal<K>*)info_.key_marshal)->marshal(i->key(), &k);
             ((Marshal<V1>*)info_.value1_marshal)->marshal(i->value1(), &v1);
             out->WriteEntryToNet(k, v1);
-            i->Next();
         }
         delete i;
     }
 
-    template <class K, class V1, class V2, class V3>
-    void StateTable<K, V1, V2, V3>::deserializeFromFile(TableCoder *in, DecodeIteratorBase *itbase) {
+    template <class K, class V1, class V2, class V3, class IK>
+    void StateTable<K, V1, V2, V3, IK>::deserializeFromFile(TableCoder *in, DecodeIteratorBase *itbase) {
         FileUpdateDecoder* it = static_cast<FileUpdateDecoder*> (itbase);
         K k;
         V1 v1;
@@ -655,8 +776,8 @@ namespace dsm {
         return;
     }
 
-    template <class K, class V1, class V2, class V3>
-    void StateTable<K, V1, V2, V3>::deserializeFromNet(KVPairCoder *in, DecodeIteratorBase *itbase) {
+    template <class K, class V1, class V2, class V3, class IK>
+    void StateTable<K, V1, V2, V3, IK>::deserializeFromNet(KVPairCoder *in, DecodeIteratorBase *itbase) {
         NetUpdateDecoder* it = static_cast<NetUpdateDecoder*> (itbase);
         K k;
         V1 v1;
@@ -675,8 +796,8 @@ namespace dsm {
     //it can also be used to generate snapshot, but currently in order to measure the performance we skip this step, 
     //but focus on termination check
 
-    template <class K, class V1, class V2, class V3>
-    void StateTable<K, V1, V2, V3>::serializeToSnapshot(const string& f, long* updates, double* totalF2) {
+    template <class K, class V1, class V2, class V3, class IK>
+    void StateTable<K, V1, V2, V3, IK>::serializeToSnapshot(const string& f, long* updates, double* totalF2) {
         total_curr = 0;
         EntirePassIterator* entireIter = new EntirePassIterator(*this);
         total_curr = static_cast<double> (((TermChecker<K, V2>*)info_.termchecker)->estimate_prog(entireIter));
@@ -685,248 +806,309 @@ namespace dsm {
         *totalF2 = total_curr;
     }
 
-    template <class K, class V1, class V2, class V3>
-    void StateTable<K, V1, V2, V3>::resize(int64_t size) {
+    template <class K, class V1, class V2, class V3, class IK>
+    void StateTable<K, V1, V2, V3, IK>::resize(int64_t size) {
         CHECK_GT(size, 0);
-        if (size_ == size)
+        //slots never move, so growing only extends the columns and, in hash
+        //mode, sizes the index for the new capacity
+        if (size <= size_)
             return;
 
-        std::vector<Bucket> old_b = buckets_;
-        //int old_entries = entries_;
+        keys_.resize(size);
+        v1_.resize(size);
+        v2_.resize(size);
+        adj_.resize(size);
+        priority_.resize(size);
+        in_use_.resize((size + 63) / 64);
+        is_copy_.resize((size + 63) / 64);
+        active_.resize((size + 63) / 64);
+        schedule_.resize(size);
+        size_ = size;
 
-        // LOG(INFO) << "Rehashing.vd.. " << entries_ << " : " << size_ << " -> " << size;
+        if (!dense_) index_.reserve(size);
+    }
 
-        buckets_.resize(size);
-        size_ = size;
-        clear();
-        //LOG(INFO) << "Rehashing... " << entries_ << " : " << size_ << " -> " << size;
-        for (int i = 0; i < old_b.size(); ++i) {
-            if (old_b[i].in_use) {
-                put(old_b[i].k, old_b[i].v1, old_b[i].v2, old_b[i].v3);
-                // LOG(INFO) << "copy: " << old_b[i].k;
-            }
+    //the slot a new key k goes to, growing the table if needed
+    template <class K, class V1, class V2, class V3, class IK>
+    int StateTable<K, V1, V2, V3, IK>::insert_slot(const K& k) {
+        if (dense_) {
+            int64_t b = DenseIndex<K>::slot(k, info_.num_shards);
+            CHECK_GE(b, 0) << "negative key <" << *((int*) &k) << "> in a dense table";
+            if (b >= size_) resize(std::max(1 + size_ * 2, b + 1));
+            return b;
         }
 
-        //CHECK_EQ(old_entries, entries_); 
+        int b;
+        if (!free_slots_.empty()) {
+            b = free_slots_.back();
+            free_slots_.pop_back();
+        } else {
+            if (used_ == size_) resize(1 + size_ * 2);
+            b = used_++;
+        }
+        index_.insert(k, b);
+        return b;
     }
 
-    template <class K, class V1, class V2, class V3>
-    bool StateTable<K, V1, V2, V3>::contains(const K& k) {
-        return bucket_for_key(k) != -1;
+    template <class K, class V1, class V2, class V3, class IK>
+    bool StateTable<K, V1, V2, V3, IK>::remove(const K& k) {
+        int b = bucket_for_key(k);
+        if (b == -1 || !in_use(b)) return false;
+
+        if (!dense_) {
+            index_.erase(k);
+            free_slots_.push_back(b);
+        }
+        //drop its pending delta too: the slot may still be queued or active, and
+        //a key put into it later must not inherit the delta
+        set_bit(in_use_, b, false);
+        set_bit(is_copy_, b, false);
+        set_bit(active_, b, false);
+        adj_.set(b, V3());
+        v1_[b] = defaultv_;
+        priority_[b] = 0;
+        --entries_;
+        return true;
     }
 
-    template <class K, class V1, class V2, class V3>
-    V1 StateTable<K, V1, V2, V3>::getF1(const K& k) {
+    template <class K, class V1, class V2, class V3, class IK>
+    bool StateTable<K, V1, V2, V3, IK>::contains(const K& k) {
+        int b = bucket_for_key(k);
+        return b != -1 && in_use(b);
+    }
+
+    template <class K, class V1, class V2, class V3, class IK>
+    V1 StateTable<K, V1, V2, V3, IK>::getF1(const K& k) {
         int b = bucket_for_key(k);
         //The following key display is a hack hack hack and only yields valid
         //results for ints.  It will display nonsense for other types.
         CHECK_NE(b, -1) << "No entry for requested key <" << *((int*) &k) << ">";
 
-        return buckets_[b].v1;
+        return v1_[b];
     }
 
-    template <class K, class V1, class V2, class V3>
-    V2 StateTable<K, V1, V2, V3>::getF2(const K& k) {
+    template <class K, class V1, class V2, class V3, class IK>
+    V2 StateTable<K, V1, V2, V3, IK>::getF2(const K& k) {
         int b = bucket_for_key(k);
         //The following key display is a hack hack hack and only yields valid
         //results for ints.  It will display nonsense for other types.
         CHECK_NE(b, -1) << "No entry for requested key <" << *((int*) &k) << ">";
 
-        return buckets_[b].v2;
+        return v2_[b];
     }
 
-    template <class K, class V1, class V2, class V3>
-    V3 StateTable<K, V1, V2, V3>::getF3(const K& k) {
+    template <class K, class V1, class V2, class V3, class IK>
+    V3 StateTable<K, V1, V2, V3, IK>::getF3(const K& k) {
         int b = bucket_for_key(k);
         //The following key display is a hack hack hack and only yields valid
         //results for ints.  It will display nonsense for other types.
         CHECK_NE(b, -1) << "No entry for requested key <" << *((int*) &k) << ">";
 
-        return buckets_[b].v3;
+        return adj_.get(b);
     }
 
-    template <class K, class V1, class V2, class V3>
-    ClutterRecord<K, V1, V2, V3> StateTable<K, V1, V2, V3>::get(const K& k) {
+    template <class K, class V1, class V2, class V3, class IK>
+    ClutterRecord<K, V1, V2, V3> StateTable<K, V1, V2, V3, IK>::get(const K& k) {
         int b = bucket_for_key(k);
         //The following key display is a hack hack hack and only yields valid
         //results for ints.  It will display nonsense for other types.
         CHECK_NE(b, -1) << "No entry for requested key <" << *((int*) &k) << ">";
 
-        return ClutterRecord<K, V1, V2, V3>(k, buckets_[b].v1, buckets_[b].v2, buckets_[b].v3);
+        return ClutterRecord<K, V1, V2, V3>(k, v1_[b], v2_[b], adj_.get(b));
     }
 
-    template <class K, class V1, class V2, class V3>
-    void StateTable<K, V1, V2, V3>::updateF1(const K& k, const V1& v) {
+    template <class K, class V1, class V2, class V3, class IK>
+    void StateTable<K, V1, V2, V3, IK>::updateF1(const K& k, const V1& v) {
         int b = bucket_for_key(k);
 
         CHECK_NE(b, -1) << "No entry for requested key <" << *((int*) &k) << ">";
 
-        buckets_[b].v1 = v;
-        buckets_[b].priority = 0; //didn't use priority function, assume the smallest priority is 0
+        SlotLock sl(*this, b);
+        v1_[b] = v;
+        priority_[b] = 0; //didn't use priority function, assume the smallest priority is 0
         total_updates++;
     }
 
-    template <class K, class V1, class V2, class V3>
-    void StateTable<K, V1, V2, V3>::updateF2(const K& k, const V2& v) {
+    template <class K, class V1, class V2, class V3, class IK>
+    V1 StateTable<K, V1, V2, V3, IK>::takeF1(const K& k, const V1& v) {
         int b = bucket_for_key(k);
 
         CHECK_NE(b, -1) << "No entry for requested key <" << *((int*) &k) << ">";
 
-        buckets_[b].v2 = v;
+        SlotLock sl(*this, b);
+        V1 old = v1_[b];
+        v1_[b] = v;
+        priority_[b] = 0;
+        if (striped_) {
+            __sync_fetch_and_add(&total_updates, 1);
+        } else {
+            total_updates++;
+        }
+        return old;
     }
 
-    template <class K, class V1, class V2, class V3>
-    void StateTable<K, V1, V2, V3>::updateF3(const K& k, const V3& v) {
+    template <class K, class V1, class V2, class V3, class IK>
+    void StateTable<K, V1, V2, V3, IK>::updateF2(const K& k, const V2& v) {
         int b = bucket_for_key(k);
 
         CHECK_NE(b, -1) << "No entry for requested key <" << *((int*) &k) << ">";
 
-        buckets_[b].v3 = v;
+        v2_[b] = v;
     }
 
-    template<class K, class V1, class V2, class V3>
-    void StateTable<K, V1, V2, V3>::accumulateFFF(const K& k, const V1& v, int shard) {
+    template <class K, class V1, class V2, class V3, class IK>
+    void StateTable<K, V1, V2, V3, IK>::updateF3(const K& k, const V3& v) {
+        int b = bucket_for_key(k);
+
+        CHECK_NE(b, -1) << "No entry for requested key <" << *((int*) &k) << ">";
 
+        adj_.set(b, v);
     }
 
-    template <class K, class V1, class V2, class V3>
-    void StateTable<K, V1, V2, V3>::accumulateFF(const K& k, const V1& v, int shard) {
+    template <class K, class V1, class V2, class V3, class IK>
+    void StateTable<K, V1, V2, V3, IK>::accumulateFFF(const K& k, const V1& v, int shard) {
 
     }
 
-    template <class K, class V1, class V2, class V3>
-    void StateTable<K, V1, V2, V3>::accumulateF1(const K& k, const V1& v) {
+    template <class K, class V1, class V2, class V3, class IK>
+    void StateTable<K, V1, V2, V3, IK>::accumulateFF(const K& k, const V1& v, int shard) {
+
+    }
+
+    template <class K, class V1, class V2, class V3, class IK>
+    void StateTable<K, V1, V2, V3, IK>::accumulateF1(const K& k, const V1& v) {
         int b = bucket_for_key(k);
 
         //cout << "accumulate " << k << "\t" << v << endl;
         CHECK_NE(b, -1) << "No entry for requested key <" << *((int*) &k) << ">" << "key: " << k;
-        ((IterateKernel<K, V1, V3>*)info_.iterkernel)->accumulate(buckets_[b].v1, v);
-        ((IterateKernel<K, V1, V3>*)info_.iterkernel)->priority(buckets_[b].priority, buckets_[b].v2, buckets_[b].v1);
+        accumulate_slot(b, v);
+    }
 
+    template <class K, class V1, class V2, class V3, class IK>
+    void StateTable<K, V1, V2, V3, IK>::accumulateF1Batch(const pair<K, V1>* begin, const pair<K, V1>* end) {
+        //resolve every slot first, then apply with the fields of later slots
+        //already on their way into the cache
+        static const int kPrefetch = 8;
+        int n = end - begin;
+        batch_slots_.resize(n);
+        for (int i = 0; i < n; ++i) {
+            int b = bucket_for_key(begin[i].first);
+            CHECK_NE(b, -1) << "No entry for requested key <" << *((int*) &begin[i].first) << ">";
+            batch_slots_[i] = b;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            if (i + kPrefetch < n) {
+                int p = batch_slots_[i + kPrefetch];
+                __builtin_prefetch(&v1_[p], 1);
+                __builtin_prefetch(&v2_[p], 0);
+                __builtin_prefetch(&priority_[p], 1);
+            }
+            accumulate_slot(batch_slots_[i], begin[i].second);
+        }
     }
 
-    template <class K, class V1, class V2, class V3>
-    void StateTable<K, V1, V2, V3>::accumulateF2(const K& k, const V2& v) {
+    template <class K, class V1, class V2, class V3, class IK>
+    void StateTable<K, V1, V2, V3, IK>::accumulateF2(const K& k, const V2& v) {
         int b = bucket_for_key(k);
 
         CHECK_NE(b, -1) << "No entry for requested key <" << *((int*) &k) << ">";
-        ((IterateKernel<K, V1, V3>*)info_.iterkernel)->accumulate(buckets_[b].v2, v);
+        SlotLock sl(*this, b);
+        KernelCalls<IK>::accumulate((IK*) info_.iterkernel, v2_[b], v);
     }
 
-    template <class K, class V1, class V2, class V3>
-    void StateTable<K, V1, V2, V3>::accumulateF3(const K& k, const V3& v) {
+    template <class K, class V1, class V2, class V3, class IK>
+    void StateTable<K, V1, V2, V3, IK>::accumulateF3(const K& k, const V3& v) {
 
     }
 
-    template <class K, class V1, class V2, class V3>
-    void StateTable<K, V1, V2, V3>::setCopy(const K& k) {
-        int start = bucket_idx(k);
-        buckets_[start].is_copy = 1;
+    template <class K, class V1, class V2, class V3, class IK>
+    void StateTable<K, V1, V2, V3, IK>::setCopy(const K& k) {
+        int b = bucket_for_key(k);
+        CHECK_NE(b, -1) << "No entry for requested key <" << *((int*) &k) << ">";
+        set_bit(is_copy_, b, true);
     }
 
-    template <class K, class V1, class V2, class V3>
-    void StateTable<K, V1, V2, V3>::setNoCopy(const K& k) {
-        int start = bucket_idx(k);
-        buckets_[start].is_copy = 0;
+    template <class K, class V1, class V2, class V3, class IK>
+    void StateTable<K, V1, V2, V3, IK>::setNoCopy(const K& k) {
+        int b = bucket_for_key(k);
+        CHECK_NE(b, -1) << "No entry for requested key <" << *((int*) &k) << ">";
+        set_bit(is_copy_, b, false);
     }
 
-    template <class K, class V1, class V2, class V3>
-    void StateTable<K, V1, V2, V3>::putc(const K &k, const V1 &v1, V3 &v3, int shard) {
+    template <class K, class V1, class V2, class V3, class IK>
+    void StateTable<K, V1, V2, V3, IK>::putc(const K &k, const V1 &v1, V3 &v3, int shard) {
 
     }
 
-    template <class K, class V1, class V2, class V3>
-    void StateTable<K, V1, V2, V3>::put(const K& k, const V1& v1, const V2& v2, const V3& v3) {
-        int start = bucket_idx(k);
-        int b = start;
-        bool found = false;
-
-        do {
-            if (!buckets_[b].in_use) {
-                break;
-            }
-
-            if (buckets_[b].k == k) {
-                found = true;
-                break;
-            }
-
-            b = (b + 1) % size_;
-        } while (b != start);
+    //the slot of k, claiming one if k is new
+    template <class K, class V1, class V2, class V3, class IK>
+    int StateTable<K, V1, V2, V3, IK>::put_slot(const K& k) {
+        int b = bucket_for_key(k);
 
         // Inserting a new entry:
-        if (!found) {
-            if (entries_ > size_ /** kLoadFactor*/) { //doesn't consider loadfactor, the tablesize is pre-defined 
-                //VLOG(0) << "resizing... " << size_ << " : " << (int)(1 + size_ * 2) << " entries "<< entries_;
-                //entries_-=1;
-                resize((int) (1 + size_ * 2));
-                put(k, v1, v2, v3);
-                ++entries_;
-                //VLOG(0) << "if entries_: " << entries_<<"  key: "<<k;
-            } else {
-                buckets_[b].in_use = 1;
-                buckets_[b].k = k;
-                buckets_[b].v1 = v1;
-                buckets_[b].v2 = v2;
-                buckets_[b].v3 = v3;
-                ((IterateKernel<K, V1, V3>*)info_.iterkernel)->priority(buckets_[b].priority, buckets_[b].v2, buckets_[b].v1);
-                ++entries_;
-                //VLOG(0) << "else entries_: " << entries_<<"  key: "<<k;
-            }
+        if (b == -1 || !in_use(b)) {
+            b = insert_slot(k);
+            set_bit(in_use_, b, true);
+            set_bit(is_copy_, b, false);
+            keys_[b] = k;
+            ++entries_;
+            //VLOG(0) << "entries_: " << entries_<<"  key: "<<k;
         } else {
-            // Replacing an existing entry
-            buckets_[b].v1 = v1;
-            buckets_[b].v2 = v2;
-            buckets_[b].v3 = v3;
-            ((IterateKernel<K, V1, V3>*)info_.iterkernel)->priority(buckets_[b].priority, buckets_[b].v2, buckets_[b].v1);
+            CHECK(!dense_ || keys_[b] == k) << "key <" << *((int*) &k) << "> collides in a dense table,"
+                    << " dense tables need keys sharded by key % num_shards";
         }
+        return b;
     }
 
-    template <class K, class V1, class V2, class V3>
-    void StateTable<K, V1, V2, V3>::put2(const K& k, const V1& v1, const V2& v2, const V3& v3) {
-        int start = bucket_idx(k);
-        int b = start;
-        bool found = false;
+    // Replacing an existing entry or filling the new one
+    template <class K, class V1, class V2, class V3, class IK>
+    void StateTable<K, V1, V2, V3, IK>::put_values(int b, const V1& v1, const V2& v2) {
+        v1_[b] = v1;
+        v2_[b] = v2;
+        KernelCalls<IK>::priority((IK*) info_.iterkernel, priority_[b], v2_[b], v1_[b]);
+        if (prioritized_) {
+            schedule_.push(b, current_bucket(b));
+        } else {
+            activate(b);
+        }
+    }
 
-        do {
-            if (!buckets_[b].in_use) {
-                break;
-            }
+    template <class K, class V1, class V2, class V3, class IK>
+    void StateTable<K, V1, V2, V3, IK>::put(const K& k, const V1& v1, const V2& v2, const V3& v3) {
+        int b = put_slot(k);
+        adj_.set(b, v3);
+        put_values(b, v1, v2);
+    }
 
-            if (buckets_[b].k == k) {
-                found = true;
-                break;
+    template <class K, class V1, class V2, class V3, class IK>
+    void StateTable<K, V1, V2, V3, IK>::bulk_build(const std::vector<K>& keys, const std::vector<V1>& v1s,
+            const std::vector<V2>& v2s, typename AdjacencyStore<V3>::Bulk& adjacency) {
+        CHECK_EQ(keys.size(), v1s.size());
+        CHECK_EQ(keys.size(), v2s.size());
+
+        //one resize up front: a dense table needs the largest key's slot, a
+        //hashed one a slot per key
+        int64_t need = used_ + keys.size();
+        if (dense_) {
+            need = 0;
+            for (size_t i = 0; i < keys.size(); ++i) {
+                need = std::max(need, DenseIndex<K>::slot(keys[i], info_.num_shards) + 1);
             }
+        }
+        if (need > size_) resize(need);
 
-            b = (b + 1) % size_;
-        } while (b != start);
-
-        // Inserting a new entry:
-        if (!found) {
-            if (entries_ > size_ /** kLoadFactor*/) { //doesn't consider loadfactor, the tablesize is pre-defined 
-                //VLOG(0) << "resizing... " << size_ << " : " << (int)(1 + size_ * 2) << " entries "<< entries_;
-                //entries_-=1;
-                resize((int) (1 + size_ * 2));
-                put(k, v1, v2, v3);
-                ++entries_;
-                //VLOG(0) << "if entries_: " << entries_<<"  key: "<<k;
-            } else {
-                buckets_[b].in_use = 1;
-                buckets_[b].k = k;
-                buckets_[b].v1 = v1;
-                buckets_[b].v2 = v2;
-                buckets_[b].v3 = v3;
-                ((IterateKernel<K, V1, V3>*)info_.iterkernel)->priority(buckets_[b].priority, buckets_[b].v2, buckets_[b].v1);
-                ++entries_;
-                //VLOG(0) << "else entries_: " << entries_<<"  key: "<<k;
-            }
-        } else {
-            // Replacing an existing entry
-            buckets_[b].v1 = v1;
-            buckets_[b].v2 = v2;
-            buckets_[b].v3 = v3;
-            ((IterateKernel<K, V1, V3>*)info_.iterkernel)->priority(buckets_[b].priority, buckets_[b].v2, buckets_[b].v1);
+        int64_t base = adj_.adopt(adjacency);
+        for (size_t i = 0; i < keys.size(); ++i) {
+            int b = put_slot(keys[i]);
+            adj_.set_bulk(b, adjacency, i, base);
+            put_values(b, v1s[i], v2s[i]);
         }
     }
+
+    template <class K, class V1, class V2, class V3, class IK>
+    void StateTable<K, V1, V2, V3, IK>::put2(const K& k, const V1& v1, const V2& v2, const V3& v3) {
+        put(k, v1, v2, v3);
+    }
 }
 #endif /* SPARSE_MAP_H_ */
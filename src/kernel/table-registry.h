@@ -9,6 +9,8 @@
 #include "kernel/deltatable.h"
 #include "kernel/CopyTable.h"
 
+DECLARE_bool(dense_table);
+
 static const int kStatsTableId = 1000000;
 
 namespace dsm {
@@ -34,10 +36,12 @@ namespace dsm {
 
     // Swig doesn't like templatized default arguments; work around that here.
 
-    template<class K, class V1, class V2, class V3>
+    //IK is deduced from iterkernel: pass a pointer to the concrete kernel type
+    //to have the local tables call it without virtual dispatch
+    template<class K, class V1, class V2, class V3, class IK>
     static TypedGlobalTable<K, V1, V2, V3>* CreateTable(int id, int shards, double schedule_portion,
             Sharder<K>* sharding,
-            IterateKernel<K, V1, V3>* iterkernel,
+            IK* iterkernel,
             TermChecker<K, V2>* termchecker) {
         TableDescriptor *info = new TableDescriptor(id, shards);
         info->key_marshal = new Marshal<K>;
@@ -45,10 +49,17 @@ namespace dsm {
         info->value2_marshal = new Marshal<V2>;
         info->value3_marshal = new Marshal<V3>;
         info->sharder = sharding;
-        info->iterkernel = iterkernel;
+        info->iterkernel = static_cast<IterateKernel<K, V1, V3>*> (iterkernel);
         info->termchecker = termchecker;
-        info->partition_factory = new typename StateTable<K, V1, V2, V3>::Factory;
-        info->deltaT_factory = new typename DeltaTable<K, V1, V3>::Factory;
+        //int keys sharded by Sharding::Mod index the state table directly
+        bool dense = FLAGS_dense_table && DenseIndex<K>::supported &&
+                (dynamic_cast<Sharding::Mod*> (sharding) || dynamic_cast<Sharding::UintMod*> (sharding));
+        if (dense) {
+            info->partition_factory = new typename StateTable<K, V1, V2, V3, IK>::DenseFactory;
+        } else {
+            info->partition_factory = new typename StateTable<K, V1, V2, V3, IK>::Factory;
+        }
+        info->deltaT_factory = new typename DeltaTable<K, V1, V3, IK>::Factory;
         info->CopyT_factory = new typename CopyTable<K, V1>::Factory;
         info->schedule_portion = schedule_portion;
 
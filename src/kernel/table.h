@@ -6,8 +6,10 @@
 #include "util/common.h"
 #include "util/file.h"
 #include "worker/worker.pb.h"
+#include "kernel/adjacency.h"
 #include <boost/thread.hpp>
 #include <boost/lexical_cast.hpp>
+#include <google/protobuf/io/coded_stream.h>
 
 DECLARE_double(termcheck_threshold);
 
@@ -46,6 +48,8 @@ namespace dsm {
         virtual int peer_for_shard(int table, int shard) const = 0;
         virtual void HandlePutRequest() = 0;
         virtual void FlushUpdates() = 0;
+        //wait up to timeout seconds for remote updates and apply them, true if any came
+        virtual bool WaitForUpdates(double timeout) = 0;
         virtual void SendTermcheck(int index, long updates, double current) = 0;
     };
 
@@ -98,16 +102,75 @@ namespace dsm {
 
     template <class K, class V, class D>
     struct IterateKernel : public IterateKernelBase {
+        //how the state table hands a vertex's data to g_func: const D& in general,
+        //an AdjacencySpan over the shard's edge array when D is a vector
+        typedef typename AdjacencyStore<D>::View Adjacency;
+
         virtual void read_data(string& line, K& k, D& data, int &size) = 0;
+        //the loader hands over each line as a view into the mapped partition
+        //file; kernels that parse it in place override this one as well
+        virtual void read_data(const StringPiece& line, K& k, D& data, int &size) {
+            string s = line.AsString();
+            read_data(s, k, data, size);
+        }
         virtual void init_c(const K& k, V& delta, D& data) = 0;
         virtual const V& default_v() const = 0;
         virtual void init_v(const K& k, V& v, D& data) = 0;
         virtual void accumulate(V& a, const V& b) = 0;
 
-        virtual void process_delta_v(const K& k, V& dalta, V& value, D& data) {
+        virtual void process_delta_v(const K& k, V& dalta, V& value, const Adjacency& data) {
         }
         virtual void priority(V& pri, const V& value, const V& delta) = 0;
-        virtual void g_func(const K& k, const V& delta, const V& value, const D& data, vector<pair<K, V> >* output) = 0;
+        virtual void g_func(const K& k, const V& delta, const V& value, const Adjacency& data, vector<pair<K, V> >* output) = 0;
+    };
+
+    //calls an iterate kernel through its static type IK. When IK is a user
+    //kernel the calls are qualified, so they bind at compile time and inline
+    //into the table and kernel loops; IK must then be the kernel's exact type.
+    template <class IK>
+    struct KernelCalls {
+
+        template <class V>
+        static void accumulate(IK* ik, V& a, const V& b) {
+            ik->IK::accumulate(a, b);
+        }
+
+        template <class V>
+        static void priority(IK* ik, V& pri, const V& value, const V& delta) {
+            ik->IK::priority(pri, value, delta);
+        }
+
+        template <class K, class V, class A>
+        static void process_delta_v(IK* ik, const K& k, V& delta, V& value, const A& data) {
+            ik->IK::process_delta_v(k, delta, value, data);
+        }
+
+        template <class K, class V, class A>
+        static void g_func(IK* ik, const K& k, const V& delta, const V& value, const A& data, vector<pair<K, V> >* output) {
+            ik->IK::g_func(k, delta, value, data, output);
+        }
+    };
+
+    //the IterateKernel interface itself keeps the virtual calls
+    template <class K, class V, class D>
+    struct KernelCalls<IterateKernel<K, V, D> > {
+        typedef IterateKernel<K, V, D> IK;
+
+        static void accumulate(IK* ik, V& a, const V& b) {
+            ik->accumulate(a, b);
+        }
+
+        static void priority(IK* ik, V& pri, const V& value, const V& delta) {
+            ik->priority(pri, value, delta);
+        }
+
+        static void process_delta_v(IK* ik, const K& k, V& delta, V& value, const typename IK::Adjacency& data) {
+            ik->process_delta_v(k, delta, value, data);
+        }
+
+        static void g_func(IK* ik, const K& k, const V& delta, const V& value, const typename IK::Adjacency& data, vector<pair<K, V> >* output) {
+            ik->g_func(k, delta, value, data, output);
+        }
     };
 
     template <class K, class V>
@@ -454,11 +517,16 @@ namespace dsm {
         virtual void setCopy(const K&k) = 0;
         virtual void setNoCopy(const K&k) = 0;
         virtual void updateF1(const K &k, const V1 &v) = 0;
+        //set F1 to v and return the F1 it replaced, atomically with respect to
+        //accumulateF1 calls from other kernel threads
+        virtual V1 takeF1(const K &k, const V1 &v) = 0;
         virtual void updateF2(const K &k, const V2 &v) = 0;
         virtual void updateF3(const K &k, const V3 &v) = 0;
         virtual void accumulateFFF(const K &k, const V1 &v, int shard) = 0;
         virtual void accumulateFF(const K &k, const V1 &v, int shard) = 0;
         virtual void accumulateF1(const K &k, const V1 &v) = 0; //4 TypeTable
+        //accumulateF1 for each pair of [begin, end)
+        virtual void accumulateF1Batch(const pair<K, V1>* begin, const pair<K, V1>* end) = 0;
         virtual void accumulateF2(const K &k, const V2 &v) = 0;
         virtual void accumulateF3(const K &k, const V3 &v) = 0;
         virtual bool remove(const K &k) = 0;
@@ -592,7 +660,8 @@ namespace dsm {
         virtual const K& key() = 0;
         virtual V1& value1() = 0;
         virtual V2& value2() = 0;
-        virtual V3& value3() = 0;
+        virtual V3 value3() = 0;
+        virtual typename AdjacencyStore<V3>::ViewRef adjacency() = 0;
         virtual bool is_copy() = 0;
 
         virtual void key_str(string *out) {
@@ -748,7 +817,7 @@ namespace dsm {
             return vv;
         }
 
-        V3& value3() {
+        V3 value3() {
             static V3 vv;
             if (intit != decodedeque.end()) {
                 vv = intit->v3;
@@ -855,10 +924,78 @@ namespace dsm {
         virtual void WriteEntryToNet(StringPiece k, StringPiece v1) = 0;
         virtual bool ReadEntryFromNet(string* k, string *v1) = 0;
 
+        //all entries at once as an array of keys followed by an array of
+        //values, the keys as GapKeys if gap_keys; false if this coder has no
+        //packed form
+        virtual bool WritePackedToNet(StringPiece keys, StringPiece values, bool gap_keys) {
+            return false;
+        }
+
         virtual ~KVPairCoder() {
         }
     };
 
+    //keys and values whose Marshal is a plain byte copy can be sent as packed
+    //fixed-width arrays instead of one Arg per entry
+    template <class K, class V>
+    struct PackedEntries {
+        static const bool supported = boost::is_pod<K>::value && boost::is_pod<V>::value;
+        //sorted integral keys can go as GapKeys
+        static const bool gap_keys = supported && boost::is_integral<K>::value;
+    };
+
+    //sorted integral keys written as a varint count followed by the varint
+    //gap of each key from the one before it
+    template <class K, bool integral = boost::is_integral<K>::value>
+    struct GapKeys {
+
+        static void encode(const K* keys, const int* order, int n, string* out) {
+            LOG(FATAL) << "gap encoding needs integral keys";
+        }
+
+        static int decode(const char* data, int len, vector<K>* keys) {
+            LOG(FATAL) << "gap encoding needs integral keys";
+            return -1;
+        }
+    };
+
+    template <class K>
+    struct GapKeys<K, true> {
+
+        //appends keys[order[0]], keys[order[1]], ... which must be ascending
+        static void encode(const K* keys, const int* order, int n, string* out) {
+            size_t pos = out->size();
+            static const int kMaxVarintBytes = 10;
+            out->resize(pos + (n + 1) * kMaxVarintBytes);
+            uint8_t* p = (uint8_t*) &(*out)[pos];
+            uint8_t* start = p;
+            p = google::protobuf::io::CodedOutputStream::WriteVarint32ToArray(n, p);
+            uint64_t prev = 0;
+            for (int i = 0; i < n; ++i) {
+                uint64_t k = (uint64_t) (int64_t) keys[order[i]];
+                p = google::protobuf::io::CodedOutputStream::WriteVarint64ToArray(k - prev, p);
+                prev = k;
+            }
+            out->resize(pos + (p - start));
+        }
+
+        //fills keys and returns the bytes read, -1 if data is malformed
+        static int decode(const char* data, int len, vector<K>* keys) {
+            google::protobuf::io::CodedInputStream in((const uint8_t*) data, len);
+            uint32_t n;
+            if (!in.ReadVarint32(&n)) return -1;
+            keys->resize(n);
+            uint64_t k = 0;
+            for (uint32_t i = 0; i < n; ++i) {
+                uint64_t gap;
+                if (!in.ReadVarint64(&gap)) return -1;
+                k += gap;
+                (*keys)[i] = (K) (int64_t) k;
+            }
+            return in.CurrentPosition();
+        }
+    };
+
     class Serializable {
     public:
         virtual void deserializeFromFile(TableCoder *in, DecodeIteratorBase *it) = 0;
@@ -231,6 +231,7 @@ namespace dsm {
         finished_ = dispatched_ = 0;
         last_checkpoint_ = Now();
         last_termcheck_ = Now();
+        barrier_timer = NULL;
         checkpointing_ = false;
         terminated_ = false;
         network_ = NetworkThread::Get();
@@ -385,12 +386,9 @@ namespace dsm {
     }
 
     void Master::terminate_iteration() {
-        for (int i = 0; i < workers_.size(); ++i) {
-            int worker_id = i;
-            TerminationNotification req;
-            req.set_epoch(0);
-            network_->Send(1 + worker_id, MTYPE_TERMINATION, req);
-        }
+        TerminationNotification req;
+        req.set_epoch(0);
+        network_->TreeBroadcast(MTYPE_TERMINATION, req);
 
         VLOG(1) << "Sent termination notifications ";
     }
@@ -406,16 +404,20 @@ namespace dsm {
         Timer cp_timer;
 
         vector<double> partials;
-        for (int i = 0; i < workers_.size(); ++i) {
-            int worker_id = i;
-            VLOG(2) << "Starting termination checking on: " << worker_id;
-
-            TermcheckDelta resp;
-            while (network_->TryRead(1 + worker_id, MTYPE_TERMCHECK_DONE, &resp)) { //read all the buffered information
-                VLOG(2) << "receive from " << worker_id << " with " << resp.delta();
-                workers_[worker_id]->current = resp.delta();
-                workers_[worker_id]->updates = resp.updates();
-                workers_[worker_id]->termchecking = true;
+        //reports come from the workers at the top of the termcheck tree, each
+        //carrying the partials of its subtree that are new since its last one
+        vector<int> children;
+        network_->TreeChildren(network_->id(), &children);
+        for (int i = 0; i < children.size(); ++i) {
+            TermcheckDeltas resp;
+            while (network_->TryRead(children[i], MTYPE_TERMCHECK_DONE, &resp)) { //read all the buffered information
+                for (int j = 0; j < resp.partial_size(); ++j) {
+                    const TermcheckDelta& p = resp.partial(j);
+                    VLOG(2) << "receive from " << p.worker() << " with " << p.delta();
+                    workers_[p.worker()]->current = p.delta();
+                    workers_[p.worker()]->updates = p.updates();
+                    workers_[p.worker()]->termchecking = true;
+                }
             }
         }
 
@@ -446,12 +448,13 @@ namespace dsm {
         } else {
             //reset
             for (int i = 0; i < workers_.size(); ++i) {
-                int worker_id = i;
-                workers_[worker_id]->termchecking = false;
+                workers_[i]->termchecking = false;
+            }
 
-                //clear buffer
-                TermcheckDelta resp;
-                while (network_->TryRead(1 + worker_id, MTYPE_TERMCHECK_DONE, &resp)) {
+            //clear buffer
+            for (int i = 0; i < children.size(); ++i) {
+                TermcheckDeltas resp;
+                while (network_->TryRead(children[i], MTYPE_TERMCHECK_DONE, &resp)) {
                 }
             }
             return false;
@@ -697,6 +700,7 @@ namespace dsm {
         KernelDone done_msg;
         int w_id = 0;
 
+        int64_t seen = network_->events();
         if (network_->TryRead(MPI::ANY_SOURCE, MTYPE_KERNEL_DONE, &done_msg, &w_id)) {
 
             w_id -= 1;
@@ -736,7 +740,7 @@ namespace dsm {
             w.ping();
             return w_id;
         } else {
-            Sleep(FLAGS_sleep_time);
+            network_->WaitForEvent(seen, FLAGS_sleep_time);
             return -1;
         }
 
@@ -889,12 +893,14 @@ namespace dsm {
         }
 
         EmptyMessage empty;
+        Timer sync_timer;
         //1st round-trip to make sure all workers have flushed everything
-        network_->SyncBroadcast(MTYPE_WORKER_FLUSH, empty);
+        network_->SyncTreeBroadcast(MTYPE_WORKER_FLUSH, empty);
 
         //2nd round-trip to make sure all workers have applied all updates
         //XXX: incorrect if MPI does not guarantee remote delivery
-        network_->SyncBroadcast(MTYPE_WORKER_APPLY, empty);
+        network_->SyncTreeBroadcast(MTYPE_WORKER_APPLY, empty);
+        VLOG(1) << "flush and apply barriers took " << sync_timer.elapsed();
 
         if (current_run_.checkpoint_type == CP_MASTER_CONTROLLED) {
             if (!checkpointing_) {
@@ -88,6 +88,10 @@ namespace dsm {
             return;
         }
 
+        bool WaitForUpdates(double timeout) {
+            return false;
+        }
+
         void SendTermcheck(int index, long updates, double current) {
             return;
         }
@@ -104,8 +108,8 @@ namespace dsm {
 
         //maiter program
 
-        template<class K, class V, class D>
-        void run_maiter(MaiterKernel<K, V, D>* maiter) {
+        template<class K, class V, class D, class IK>
+        void run_maiter(MaiterKernel<K, V, D, IK>* maiter) {
             if (maiter->sharder == NULL) {
                 // maiter->sharder = new Sharding::Mod;
             }
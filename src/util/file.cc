@@ -1,8 +1,11 @@
 #include "util/file.h"
 #include "util/common.h"
+#include "util/static-initializers.h"
 #include "google/protobuf/message.h"
 #include <stdio.h>
 #include <glob.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 
 namespace dsm {
 
@@ -132,6 +135,102 @@ LocalFile::LocalFile(const string &name, const string& mode) {
   setvbuf(fp, NULL, _IOFBF, kFileBufferSize);
 }
 
+MappedFile::MappedFile(const string& path) : data_(NULL), size_(0), pos_(0), path_(path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  PCHECK(fd != -1) << "; failed to open file " << path;
+  struct stat st;
+  PCHECK(fstat(fd, &st) == 0) << "; failed to stat file " << path;
+  size_ = st.st_size;
+  if (size_ > 0) {
+    void* p = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    PCHECK(p != MAP_FAILED) << "; failed to map file " << path;
+    madvise(p, size_, MADV_SEQUENTIAL);
+    data_ = (const char*)p;
+  }
+  close(fd);
+}
+
+MappedFile::~MappedFile() {
+  if (data_) {
+    munmap((void*)data_, size_);
+  }
+}
+
+bool MappedFile::read_line(StringPiece* line) {
+  const char* pos = data_ + pos_;
+  if (!read_line(&pos, data_ + size_, line)) {
+    return false;
+  }
+  pos_ = pos - data_;
+  return true;
+}
+
+bool MappedFile::read_line(const char** pos, const char* end, StringPiece* line) {
+  const char* start = *pos;
+  if (start >= end) {
+    return false;
+  }
+  const char* nl = (const char*)memchr(start, '\n', end - start);
+  size_t len = nl ? nl - start : end - start;
+  *pos = nl ? nl + 1 : end;
+  *line = StringPiece(start, len);
+  return true;
+}
+
+vector<size_t> MappedFile::split_lines(int n) const {
+  vector<size_t> at(1, 0);
+  for (int i = 1; i < n; ++i) {
+    size_t cut = std::max(size_ / n * i, at.back());
+    const char* nl = cut < size_ ? (const char*)memchr(data_ + cut, '\n', size_ - cut) : NULL;
+    at.push_back(nl ? nl - data_ + 1 : size_);
+  }
+  at.push_back(size_);
+  return at;
+}
+
+static void TestMappedFileLines() {
+  string path = StringPrintf("/tmp/mapped-file-test.%d", getpid());
+  StringPiece line;
+
+  File::Dump(path, "");
+  {
+    MappedFile f(path);
+    CHECK(!f.read_line(&line));
+    vector<size_t> at = f.split_lines(4);
+    CHECK_EQ(at.size(), 5);
+    for (int i = 0; i < at.size(); ++i) {
+      CHECK_EQ(at[i], 0);
+    }
+  }
+
+  // a blank line, and no newline after the last line
+  File::Dump(path, "1\t2 3\n\n4\t5");
+  {
+    MappedFile f(path);
+    CHECK(f.read_line(&line));
+    CHECK_EQ(line.AsString(), "1\t2 3");
+    CHECK(f.read_line(&line));
+    CHECK_EQ(line.len, 0);
+    CHECK(f.read_line(&line));
+    CHECK_EQ(line.AsString(), "4\t5");
+    CHECK(!f.read_line(&line));
+
+    // the ranges cover the file in order and each starts a line
+    for (int n = 1; n <= 12; ++n) {
+      vector<size_t> at = f.split_lines(n);
+      CHECK_EQ(at.size(), n + 1);
+      CHECK_EQ(at.front(), 0);
+      CHECK_EQ(at.back(), f.size());
+      for (int i = 1; i < n; ++i) {
+        CHECK_LE(at[i - 1], at[i]);
+        CHECK(at[i] == f.size() || f.data()[at[i] - 1] == '\n');
+      }
+    }
+  }
+  unlink(path.c_str());
+}
+REGISTER_TEST(MappedFileLines, TestMappedFileLines());
+
 template <class T>
 void Encoder::write(const T& v) {
   if (out_) {
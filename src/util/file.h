@@ -91,6 +91,34 @@ private:
   bool close_on_delete;
 };
 
+// A whole file mapped read-only into memory.  read_line hands out views into
+// the mapping without copying, so they stay valid until the file is deleted.
+class MappedFile : private boost::noncopyable {
+public:
+  MappedFile(const string& path);
+  ~MappedFile();
+
+  // The next line without its '\n'; false at the end of the file.
+  bool read_line(StringPiece* line);
+
+  // The same over the bytes [*pos, end) of a mapping, moving *pos past the line.
+  static bool read_line(const char** pos, const char* end, StringPiece* line);
+
+  // n + 1 offsets cutting the file into n ranges of about equal size, each
+  // starting at the beginning of a line; range i is [at[i], at[i + 1]).
+  vector<size_t> split_lines(int n) const;
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+  const char* name() const { return path_.c_str(); }
+
+private:
+  const char* data_;
+  size_t size_;
+  size_t pos_;
+  string path_;
+};
+
 class Encoder {
 public:
   Encoder(string *s) : out_(s), out_f_(NULL) {}
@@ -0,0 +1,111 @@
+#ifndef UTIL_MPSC_QUEUE_H
+#define UTIL_MPSC_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace dsm {
+
+// A link in an MPSCQueue.  Queued values derive from it, so a push links the
+// value itself in and allocates nothing.
+struct MPSCNode {
+  MPSCNode* volatile next;
+};
+
+// An unbounded multi-producer, single-consumer queue of MPSCNode-derived
+// values, after Vyukov's intrusive node-based queue.  push takes no lock and
+// never waits; pop must not be called from two threads at once.  A value is
+// in at most one queue at a time.  A push that is still linking its value
+// can make pop report an empty queue for a moment, but not idle().
+template <class T>
+class MPSCQueue {
+public:
+  MPSCQueue() : head_(&stub_), tail_(&stub_) {
+    stub_.next = NULL;
+  }
+
+  // The queue owns what it holds: values still queued are deleted.
+  ~MPSCQueue() {
+    T* v;
+    while (pop(&v)) {
+      delete v;
+    }
+  }
+
+  void push(T* v) {
+    link(v);
+  }
+
+  bool pop(T** v) {
+    MPSCNode* tail = tail_;
+    MPSCNode* next = tail->next;
+    if (tail == &stub_) {
+      if (next == NULL) {
+        return false;
+      }
+      tail_ = next;
+      tail = next;
+      next = next->next;
+    }
+
+    if (next == NULL) {
+      if (tail != head_) {
+        return false;
+      }
+      // tail is the last node; queue the stub behind it so it can go.
+      link(&stub_);
+      next = tail->next;
+      if (next == NULL) {
+        return false;
+      }
+    }
+
+    tail_ = next;
+    *v = static_cast<T*>(tail);
+    return true;
+  }
+
+  // True if nothing has been pushed that pop has not returned, including
+  // pushes that are still in progress.
+  bool idle() const {
+    return tail_ == &stub_ && head_ == &stub_;
+  }
+
+private:
+  void link(MPSCNode* n) {
+    n->next = NULL;
+    __sync_synchronize();
+    MPSCNode* prev = __sync_lock_test_and_set(&head_, n);
+    prev->next = n;
+  }
+
+  // Producers swap themselves into head_; the consumer owns tail_.
+  MPSCNode* volatile head_;
+  MPSCNode* volatile tail_;
+  MPSCNode stub_;
+};
+
+// Ready bits over a set of queues: bit is set in *word after every push to
+// q, and PopReady clears it once q is idle, setting it again if a push raced
+// with the clear, so a queue holding values never has its bit clear.
+template <class T>
+static void PushReady(MPSCQueue<T>* q, T* v, uint64_t* word, uint64_t bit) {
+  q->push(v);
+  __sync_fetch_and_or(word, bit);
+}
+
+template <class T>
+static bool PopReady(MPSCQueue<T>* q, T** v, uint64_t* word, uint64_t bit) {
+  bool found = q->pop(v);
+  if (q->idle()) {
+    __sync_fetch_and_and(word, ~bit);
+    if (!q->idle()) {
+      __sync_fetch_and_or(word, bit);
+    }
+  }
+  return found;
+}
+
+}
+
+#endif // UTIL_MPSC_QUEUE_H
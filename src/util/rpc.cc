@@ -1,11 +1,19 @@
 #include "util/rpc.h"
 #include "util/common.h"
 #include "util/common.pb.h"
+#include "util/static-initializers.h"
 #include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 
 DECLARE_bool(localtest);
 DECLARE_double(sleep_time);
 DEFINE_bool(rpc_log, false, "");
+DEFINE_bool(shm_transport, true, "send put requests to ranks on the same host through shared-memory rings instead of MPI");
+DEFINE_int32(shm_ring_size, 4 << 20, "bytes in each shared-memory ring between two ranks on the same host");
+DEFINE_int32(tree_fanout, 8, "children per rank in the tree that barriers, termination notices and termcheck reports travel through");
+DEFINE_int32(tree_min_workers, 0, "use that tree from this many workers up; 0 always sends those messages between the master and each worker directly");
+DEFINE_int64(put_window, 4 << 20, "bytes of put requests a worker may have sent to a peer that the peer has not read yet");
 
 namespace dsm {
 
@@ -20,8 +28,12 @@ static void CrashOnMPIError(MPI_Comm * c, int * errorCode, ...) {
 }
 
 struct Header {
-  Header() : is_reply(false) {}
+  Header() : is_reply(false), tree(false), sent(0) {}
   bool is_reply;
+  // Sent by TreeBroadcast; the receiver passes it on to its children.
+  bool tree;
+  // Now() when the message was queued for sending.
+  double sent;
 };
 
 // Represents an active RPC to a remote peer.
@@ -54,6 +66,7 @@ RPCRequest::RPCRequest(int tgt, int method, const Message& ureq, Header h) {
   target = tgt;
   rpc_type = method;
 
+  h.sent = Now();
   payload.append((char*)&h, sizeof(Header));
   ureq.AppendToString(&payload);
 }
@@ -63,10 +76,20 @@ RPCRequest::RPCRequest(int tgt, int method, Header h) {
   target = tgt;
   rpc_type = method;
 
+  h.sent = Now();
   payload.append((char*)&h, sizeof(Header));
 }
 
-NetworkThread::NetworkThread() {
+NetworkThread::NetworkThread() : shm_pending_count_(0), shm_pending_bytes_(0), events_(0), idle_rounds_(0) {
+  for (int i = 0; i < kLatencyBuckets; ++i) {
+    put_latency_[i] = 0;
+  }
+  for (int i = 0; i < kMaxHosts; ++i) {
+    in_flight_[i] = in_flight_peak_[i] = unreturned_[i] = 0;
+  }
+  memset(ready_, 0, sizeof(ready_));
+  memset(tree_pending_, 0, sizeof(tree_pending_));
+
   if (!getenv("OMPI_COMM_WORLD_RANK")) {
     world_ = NULL;
     id_ = -1;
@@ -81,9 +104,15 @@ NetworkThread::NetworkThread() {
   MPI::COMM_WORLD.Set_errhandler(handler);
 
   world_ = &MPI::COMM_WORLD;
+  for (int i = 0; i < kMaxMethods; ++i) {
+    received_stat_[i] = StringPrintf("received.%s", MessageTypes_Name((MessageTypes)i).c_str());
+  }
+
+  id_ = world_->Get_rank();
+  InitSharedMemory();
+
   running = 1;
   t_ = new boost::thread(&NetworkThread::Run, this);
-  id_ = world_->Get_rank();
 
   for (int i = 0; i < kMaxMethods; ++i) {
     callbacks_[i] = NULL;
@@ -91,7 +120,7 @@ NetworkThread::NetworkThread() {
 }
 
 bool NetworkThread::active() const {
-  return active_sends_.size() + pending_sends_.size() > 0;
+  return active_sends_.size() + pending_sends_.size() + shm_pending_count_ > 0;
 }
 
 int NetworkThread::size() const {
@@ -102,170 +131,753 @@ int64_t NetworkThread::pending_bytes() const {
   boost::recursive_mutex::scoped_lock sl(send_lock);
   int64_t t = 0;
 
-  for (unordered_set<RPCRequest*>::const_iterator i = active_sends_.begin(); i != active_sends_.end(); ++i) {
-    t += (*i)->payload.size();
+  for (int i = 0; i < active_sends_.size(); ++i) {
+    t += active_sends_[i]->payload.size();
   }
 
   for (int i = 0; i < pending_sends_.size(); ++i) {
     t += pending_sends_[i]->payload.size();
   }
 
-  return t;
+  return t + shm_pending_bytes_;
 }
 
-void NetworkThread::CollectActive() {
-  if (active_sends_.empty())
+// Finds the ranks on this host and maps a ring for every pair of them.  Each
+// rank creates one segment holding the rings its same-host peers write to it
+// through, indexed by the writer's rank on the host; the names are unlinked
+// once every peer has mapped them.  Collective over MPI_COMM_WORLD.
+void NetworkThread::InitSharedMemory() {
+  int n = world_->Get_size();
+  shm_in_.assign(n, NULL);
+  shm_out_.assign(n, NULL);
+  shm_pending_.resize(n);
+  same_host_.assign(n, false);
+
+  MPI_Comm node;
+  MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, id_, MPI_INFO_NULL, &node);
+  int local_n, local_id;
+  MPI_Comm_size(node, &local_n);
+  MPI_Comm_rank(node, &local_id);
+  vector<int> ranks(local_n);
+  MPI_Allgather(&id_, 1, MPI_INT, &ranks[0], 1, MPI_INT, node);
+  for (int i = 0; i < local_n; ++i) {
+    same_host_[ranks[i]] = true;
+  }
+  if (!FLAGS_shm_transport || local_n == 1) {
+    MPI_Comm_free(&node);
     return;
+  }
 
-  boost::recursive_mutex::scoped_lock sl(send_lock);
-  unordered_set<RPCRequest*>::iterator i = active_sends_.begin();
-  //VLOG(3) << "Pending sends: " << active_sends_.size();
-  while (i != active_sends_.end()) {
-    RPCRequest *r = (*i);
-   // VLOG(3) << "Pending: " << MP(id(), MP(r->target, r->rpc_type));
-    if (r->finished()) {
-      if (r->failures > 0) {
-        LOG(INFO) << "Send " << MP(id(), r->target) << " of size " << r->payload.size()
-                  << " succeeded after " << r->failures << " failures.";
+  int job = getpid();
+  MPI_Bcast(&job, 1, MPI_INT, 0, node);
+
+  size_t capacity = (size_t)FLAGS_shm_ring_size / 8 * 8;
+  size_t ring_bytes = (ShmRing::bytes_for(capacity) + 63) / 64 * 64;
+  size_t segment_bytes = ring_bytes * local_n;
+
+  string name = StringPrintf("/maiter.%d.%d", job, id_);
+  int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  PCHECK(fd >= 0) << "shm_open " << name;
+  PCHECK(ftruncate(fd, segment_bytes) == 0) << "ftruncate " << name;
+  char* mine = (char*)mmap(NULL, segment_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  PCHECK(mine != MAP_FAILED) << "mmap " << name;
+  close(fd);
+  for (int i = 0; i < local_n; ++i) {
+    ((ShmRing*)(mine + i * ring_bytes))->init(capacity);
+  }
+
+  MPI_Barrier(node);
+  for (int i = 0; i < local_n; ++i) {
+    int peer = ranks[i];
+    if (peer == id_) {
+      continue;
+    }
+
+    string peer_name = StringPrintf("/maiter.%d.%d", job, peer);
+    int pfd = shm_open(peer_name.c_str(), O_RDWR, 0600);
+    PCHECK(pfd >= 0) << "shm_open " << peer_name;
+    char* theirs = (char*)mmap(NULL, segment_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, pfd, 0);
+    PCHECK(theirs != MAP_FAILED) << "mmap " << peer_name;
+    close(pfd);
+
+    shm_in_[peer] = (ShmRing*)(mine + i * ring_bytes);
+    shm_out_[peer] = (ShmRing*)(theirs + local_id * ring_bytes);
+  }
+  MPI_Barrier(node);
+  shm_unlink(name.c_str());
+  MPI_Comm_free(&node);
+
+  VLOG(1) << "rank " << id_ << " shares memory with " << local_n - 1 << " ranks on its host";
+}
+
+// Moves queued put requests into the rings of their same-host peers, in
+// order, until a ring is full.  A request too big for any ring goes by MPI.
+int NetworkThread::FlushShared() {
+  if (shm_pending_count_ == 0) {
+    return 0;
+  }
+
+  int sent = 0;
+  for (int p = 0; p < shm_pending_.size(); ++p) {
+    deque<RPCRequest*>& q = shm_pending_[p];
+    while (!q.empty()) {
+      RPCRequest* r = q.front();
+      int64_t bytes = r->payload.size();
+      if (ShmRing::frame_size(r->payload.size()) > shm_out_[p]->capacity()) {
+        boost::recursive_mutex::scoped_lock sl(send_lock);
+        StartSend(r);
+      } else if (shm_out_[p]->write(r->rpc_type, r->payload.data(), r->payload.size())) {
+        add_stat("shm_bytes_sent", r->payload.size());
+        delete r;
+      } else {
+        break;
       }
-      //VLOG(3) << "Finished send to " << r->target << " of size " << r->payload.size();
-      delete r;
-      i = active_sends_.erase(i);
+      q.pop_front();
+      --shm_pending_count_;
+      shm_pending_bytes_ -= bytes;
+      ++sent;
+    }
+  }
+  return sent;
+}
+
+// Delivers whatever same-host peers have written to us.
+int NetworkThread::PollShared() {
+  int received = 0;
+  for (int p = 0; p < shm_in_.size(); ++p) {
+    if (shm_in_[p] == NULL || shm_in_[p]->empty()) {
       continue;
     }
-    ++i;
+
+    int tag;
+    Buffer* data = AcquireBuffer();
+    while (shm_in_[p]->read(&tag, data)) {
+      add_stat("shm_bytes_received", data->size());
+      Deliver(p, tag, data);
+      data = AcquireBuffer();
+      ++received;
+    }
+    ReleaseBuffer(data);
+  }
+  return received;
+}
+
+// A ring in private memory, for the tests below.
+static ShmRing* NewTestRing(size_t capacity) {
+  ShmRing* r = (ShmRing*) new uint64_t[ShmRing::bytes_for(capacity) / 8 + 1];
+  r->init(capacity);
+  return r;
+}
+
+static void TestShmRing() {
+  ShmRing* r = NewTestRing(64);
+  int tag;
+  string out;
+  CHECK(!r->read(&tag, &out));
+
+  // a message whose frame is larger than the ring never fits
+  string big(64, 'b');
+  CHECK(!r->write(1, big.data(), big.size()));
+
+  // frames of every size, so they wrap at every offset; a full ring refuses
+  // the write until the oldest message is read
+  deque<string> expect;
+  for (int i = 0; i < 1000; ++i) {
+    string m(i % 41, 'a' + i % 26);
+    while (!r->write(i, m.data(), m.size())) {
+      CHECK(!expect.empty());
+      CHECK(r->read(&tag, &out));
+      CHECK_EQ(out, expect.front());
+      CHECK_EQ(tag, i - expect.size());
+      expect.pop_front();
+    }
+    expect.push_back(m);
+  }
+  while (!expect.empty()) {
+    CHECK(r->read(&tag, &out));
+    CHECK_EQ(out, expect.front());
+    expect.pop_front();
+  }
+  CHECK(r->empty());
+  CHECK(!r->read(&tag, &out));
+  delete[] (uint64_t*) r;
+}
+REGISTER_TEST(ShmRing, TestShmRing());
+
+// A peer that fills its ring with puts and, once the last one is in, sends a
+// barrier through MPI.
+struct RingBarrierPeer {
+  ShmRing* ring;
+  int puts;
+  volatile int barrier;
+
+  void Run() {
+    for (int i = 0; i < puts; ++i) {
+      while (!ring->write(MTYPE_PUT_REQUEST, (const char*) &i, sizeof(i))) {
+        boost::thread::yield();
+      }
+    }
+    __sync_synchronize();
+    barrier = 1;
+  }
+};
+
+static void DrainTestRing(ShmRing* r, int* seen) {
+  int tag;
+  string out;
+  while (r->read(&tag, &out)) {
+    CHECK_EQ(*(const int*) out.data(), *seen);
+    ++*seen;
   }
 }
 
-void NetworkThread::InvokeCallback(CallbackInfo *ci, RPCInfo rpc) {
+// The receiving side in the order Run follows: drain, probe, and drain again
+// before a barrier is handled; by then every put sent before it is in.
+static void TestShmRingBarrier() {
+  RingBarrierPeer peer;
+  peer.ring = NewTestRing(256);
+  peer.puts = 100000;
+  peer.barrier = 0;
+  boost::thread t(boost::bind(&RingBarrierPeer::Run, &peer));
+
+  int seen = 0;
+  while (true) {
+    DrainTestRing(peer.ring, &seen);
+    if (peer.barrier) {
+      __sync_synchronize();
+      DrainTestRing(peer.ring, &seen);
+      CHECK_EQ(seen, peer.puts);
+      break;
+    }
+    boost::thread::yield();
+  }
+  t.join();
+  delete[] (uint64_t*) peer.ring;
+}
+REGISTER_TEST(ShmRingBarrier, TestShmRingBarrier());
+
+struct TestNode : public MPSCNode {
+  int producer;
+  int n;
+};
+
+static void TestMPSCQueue() {
+  MPSCQueue<TestNode> q;
+  TestNode* v;
+  CHECK(q.idle());
+  CHECK(!q.pop(&v));
+
+  TestNode a[3];
+  for (int i = 0; i < 3; ++i) {
+    q.push(&a[i]);
+  }
+  CHECK(!q.idle());
+  for (int i = 0; i < 3; ++i) {
+    CHECK(q.pop(&v));
+    CHECK_EQ(v, &a[i]);
+  }
+  CHECK(!q.pop(&v));
+  CHECK(q.idle());
+
+  // a popped value can go straight back in
+  q.push(&a[1]);
+  q.push(&a[0]);
+  CHECK(q.pop(&v));
+  CHECK_EQ(v, &a[1]);
+  q.push(&a[1]);
+  CHECK(q.pop(&v));
+  CHECK_EQ(v, &a[0]);
+  CHECK(q.pop(&v));
+  CHECK_EQ(v, &a[1]);
+  CHECK(q.idle());
+
+  // values still queued are deleted with the queue
+  MPSCQueue<TestNode>* owner = new MPSCQueue<TestNode>;
+  owner->push(new TestNode);
+  owner->push(new TestNode);
+  delete owner;
+}
+REGISTER_TEST(MPSCQueue, TestMPSCQueue());
+
+struct ReadyProducer {
+  MPSCQueue<TestNode>* q;
+  uint64_t* word;
+  int id;
+  int n;
+  volatile int* finished;
+
+  void Run() {
+    for (int i = 0; i < n; ++i) {
+      TestNode* v = new TestNode;
+      v->producer = id;
+      v->n = i;
+      PushReady(q, v, word, 1ULL << 5);
+      if (i % 64 == 0) {
+        boost::thread::yield();
+      }
+    }
+    __sync_fetch_and_add(finished, 1);
+  }
+};
+
+// Pushes racing with the consumer's clear of the ready bit: once every
+// producer is done, a clear bit must mean an idle queue.
+static void TestReadyBits() {
+  const int kProducers = 3;
+  const int kValues = 50000;
+  MPSCQueue<TestNode> q;
+  uint64_t word = 0;
+  volatile int finished = 0;
+  ReadyProducer p[kProducers];
+  boost::thread_group threads;
+  for (int i = 0; i < kProducers; ++i) {
+    ReadyProducer r = { &q, &word, i, kValues, &finished };
+    p[i] = r;
+    threads.create_thread(boost::bind(&ReadyProducer::Run, &p[i]));
+  }
+
+  vector<int> next(kProducers, 0);
+  int received = 0;
+  while (true) {
+    bool done = finished == kProducers;
+    __sync_synchronize();
+    if (!(word & (1ULL << 5))) {
+      if (done) {
+        CHECK_EQ(received, kProducers * kValues) << "values queued behind a clear ready bit";
+        break;
+      }
+      boost::thread::yield();
+      continue;
+    }
+
+    TestNode* v;
+    if (PopReady(&q, &v, &word, 1ULL << 5)) {
+      CHECK_EQ(v->n, next[v->producer]);
+      ++next[v->producer];
+      ++received;
+      delete v;
+    }
+  }
+  threads.join_all();
+  CHECK(q.idle());
+}
+REGISTER_TEST(ReadyBits, TestReadyBits());
+
+void NetworkThread::StartSend(RPCRequest* s) {
+  s->start_time = Now();
+  s->mpi_req = world_->Isend(
+      s->payload.data(), s->payload.size(), MPI::BYTE, s->target, s->rpc_type);
+  active_sends_.push_back(s);
+}
+
+// Retires the sends MPI has completed, all in one MPI_Testsome; returns how
+// many there were.
+int NetworkThread::CollectActive() {
+  if (active_sends_.empty())
+    return 0;
+
+  boost::recursive_mutex::scoped_lock sl(send_lock);
+  int n = active_sends_.size();
+  active_reqs_.resize(n);
+  completed_.resize(n);
+  for (int i = 0; i < n; ++i) {
+    active_reqs_[i] = active_sends_[i]->mpi_req;
+  }
+
+  int done = 0;
+  MPI_Testsome(n, &active_reqs_[0], &done, &completed_[0], MPI_STATUSES_IGNORE);
+  if (done == MPI_UNDEFINED || done == 0) {
+    return 0;
+  }
+
+  for (int i = 0; i < done; ++i) {
+    RPCRequest *r = active_sends_[completed_[i]];
+    if (r->failures > 0) {
+      LOG(INFO) << "Send " << MP(id(), r->target) << " of size " << r->payload.size()
+                << " succeeded after " << r->failures << " failures.";
+    }
+    //VLOG(3) << "Finished send to " << r->target << " of size " << r->payload.size();
+    delete r;
+    active_sends_[completed_[i]] = NULL;
+  }
+  active_sends_.erase(std::remove(active_sends_.begin(), active_sends_.end(), (RPCRequest*)NULL),
+                      active_sends_.end());
+  return done;
+}
+
+NetworkThread::Buffer* NetworkThread::AcquireBuffer() {
+  boost::mutex::scoped_lock sl(pool_lock_);
+  if (buffer_pool_.empty()) {
+    return new Buffer;
+  }
+  Buffer* b = buffer_pool_.back();
+  buffer_pool_.pop_back();
+  return b;
+}
+
+void NetworkThread::ReleaseBuffer(Buffer* buffer) {
+  if (buffer->capacity() <= kMaxPooledBufferSize) {
+    boost::mutex::scoped_lock sl(pool_lock_);
+    if (buffer_pool_.size() < kMaxPooledBuffers) {
+      buffer_pool_.push_back(buffer);
+      return;
+    }
+  }
+  delete buffer;
+}
+
+void NetworkThread::InvokeCallback(CallbackInfo *ci, RPCInfo rpc, bool tree) {
   ci->call(rpc);
+  Reply(ci, rpc, tree);
+}
+
+void NetworkThread::Reply(CallbackInfo *ci, const RPCInfo& rpc, bool tree) {
+  if (tree) {
+    TreeDone(rpc.tag);
+    return;
+  }
   Header reply_header;
   reply_header.is_reply = true;
   Send(new RPCRequest(rpc.source, rpc.tag, *ci->resp, reply_header));
 }
 
-void NetworkThread::Run() {
-  while (running) {
-    MPI::Status st;
+// Passes a tree broadcast from 'parent' on to our children.  We reply to the
+// parent once they all have and our own callback is done.
+void NetworkThread::ForwardTree(int parent, int tag, const string& data) {
+  vector<int> children;
+  TreeChildren(id(), &children);
+  tree_parent_[tag] = parent;
+  tree_pending_[tag] = children.size() + 1;
+
+  Header h;
+  h.tree = true;
+  for (int i = 0; i < children.size(); ++i) {
+    RPCRequest* r = new RPCRequest(children[i], tag, h);
+    r->payload.append(data, sizeof(Header), string::npos);
+    Send(r);
+  }
+}
 
-    if (world_->Iprobe(MPI::ANY_SOURCE, MPI::ANY_TAG, st)) {
-      int tag = st.Get_tag();
-      int source = st.Get_source();
-      int bytes = st.Get_count(MPI::BYTE);
+void NetworkThread::TreeDone(int tag) {
+  if (__sync_sub_and_fetch(&tree_pending_[tag], 1) == 0) {
+    Header reply_header;
+    reply_header.is_reply = true;
+    Send(new RPCRequest(tree_parent_[tag], tag, *callbacks_[tag]->resp, reply_header));
+  }
+}
 
-      string data;
-      data.resize(bytes);
+// Called when a loop of the network thread found nothing to do: it yields
+// for the first few rounds, then sleeps for doubling periods up to
+// FLAGS_sleep_time.  A Send wakes it early.
+void NetworkThread::Backoff() {
+  static const int kYieldRounds = 64;
+  static const double kMinSleep = 10e-6;
 
-      world_->Recv(&data[0], bytes, MPI::BYTE, source, tag, st);
+  ++idle_rounds_;
+  if (idle_rounds_ <= kYieldRounds) {
+    boost::this_thread::yield();
+    return;
+  }
 
-      Header *h = (Header*)&data[0];
+  double t = kMinSleep * (1 << std::min(idle_rounds_ - kYieldRounds, 20));
+  t = std::min(t, FLAGS_sleep_time);
+  boost::mutex::scoped_lock sl(wake_lock_);
+  if (pending_sends_.empty()) {
+    wake_.timed_wait(sl, boost::posix_time::microseconds((int64_t)(t * 1e6)));
+  }
+}
 
-      stats["bytes_received"] += bytes;
-      stats[StringPrintf("received.%s", MessageTypes_Name((MessageTypes)tag).c_str())] += 1;
-      CHECK_LT(source, kMaxHosts);
+// Hands a received message to its callback or queues it for a reader.
+void NetworkThread::Deliver(int source, int tag, Buffer* data) {
+  Header *h = (Header*)&(*data)[0];
+
+  add_stat(received_stat_[tag], 1);
+  CHECK_LT(source, kMaxHosts);
+
+ // VLOG(2) << "Received packet - source: " << source << " tag: " << tag;
+  if (tag == MTYPE_PUT_CREDIT) {
+    PutCredit credit;
+    credit.ParseFromArray(data->data() + sizeof(Header), data->size() - sizeof(Header));
+    ReleaseBuffer(data);
+    __sync_fetch_and_sub(&in_flight_[source], credit.bytes());
+  } else if (h->is_reply && tree_pending_[tag] > 0 && TreeParent(source) == id()) {
+    // a child finished its part of a tree broadcast
+    ReleaseBuffer(data);
+    TreeDone(tag);
+  } else if (h->is_reply) {
+    replies[tag][source].push(data);
+  } else {
+    if (callbacks_[tag] != NULL) {
+      CallbackInfo *ci = callbacks_[tag];
+      bool tree = h->tree;
+      if (tree) {
+        ForwardTree(source, tag, *data);
+      }
+      ci->req->ParseFromArray(data->data() + sizeof(Header), data->size() - sizeof(Header));
+      ReleaseBuffer(data);
+      //VLOG(2) << "Got incoming: " << ci->req->ShortDebugString();
 
-     // VLOG(2) << "Received packet - source: " << source << " tag: " << tag;
-      if (h->is_reply) {
-        boost::recursive_mutex::scoped_lock sl(q_lock[tag]);
-        replies[tag][source].push_back(data);
+      RPCInfo rpc = { source, id(), tag };
+      if (ci->spawn_thread) {
+        new boost::thread(boost::bind(&NetworkThread::InvokeCallback, this, ci, rpc, tree));
       } else {
-        if (callbacks_[tag] != NULL) {
-          CallbackInfo *ci = callbacks_[tag];
-          ci->req->ParseFromArray(&data[0] + sizeof(Header), data.size() - sizeof(Header));
-          //VLOG(2) << "Got incoming: " << ci->req->ShortDebugString();
-
-          RPCInfo rpc = { source, id(), tag };
-          if (ci->spawn_thread) {
-            new boost::thread(boost::bind(&NetworkThread::InvokeCallback, this, ci, rpc));
-          } else {
-            ci->call(rpc);
-            Header reply_header;
-            reply_header.is_reply = true;
-            Send(new RPCRequest(source, tag, *ci->resp, reply_header));
-          }
-        } else {
-          boost::recursive_mutex::scoped_lock sl(q_lock[tag]);
-          requests[tag][source].push_back(data);
-        }
+        ci->call(rpc);
+        Reply(ci, rpc, tree);
       }
     } else {
-      Sleep(FLAGS_sleep_time);
+      PushReady(&requests[tag][source], data, &ready_[tag][source / 64], 1ULL << (source % 64));
+    }
+  }
+}
+
+void NetworkThread::Run() {
+  MPI_Comm comm = *world_;
+  while (running) {
+    bool busy = false;
+
+    // Same-host peers write their puts to the rings before anything they send
+    // after them through MPI, so the rings are drained first: a flush or
+    // apply barrier must not be handled ahead of the puts sent before it.
+    if (PollShared() > 0) {
+      busy = true;
+    }
+
+    int flag = 0;
+    MPI_Message msg;
+    MPI_Status st;
+    MPI_Improbe(MPI_ANY_SOURCE, MPI_ANY_TAG, comm, &flag, &msg, &st);
+    if (flag) {
+      int tag = st.MPI_TAG;
+      int source = st.MPI_SOURCE;
+      int bytes;
+      MPI_Get_count(&st, MPI_BYTE, &bytes);
+
+      // Receive straight into a pooled buffer; queued requests and replies
+      // hold on to it until they are parsed.
+      Buffer* data = AcquireBuffer();
+      data->resize(bytes);
+
+      MPI_Mrecv(&(*data)[0], bytes, MPI_BYTE, &msg, MPI_STATUS_IGNORE);
+
+      // puts written to a ring since the drain above may precede this
+      // message too; only a put can be handled without looking again
+      if (tag != MTYPE_PUT_REQUEST) {
+        PollShared();
+      }
+      add_stat("bytes_received", bytes);
+      Deliver(source, tag, data);
+      busy = true;
     }
 
     while (!pending_sends_.empty()) {
       boost::recursive_mutex::scoped_lock sl(send_lock);
       RPCRequest* s = pending_sends_.back();
       pending_sends_.pop_back();
-      s->start_time = Now();
-      s->mpi_req = world_->Isend(
-          s->payload.data(), s->payload.size(), MPI::BYTE, s->target, s->rpc_type);
-      active_sends_.insert(s);
+      if (s->rpc_type == MTYPE_PUT_REQUEST && shm_out_[s->target] != NULL) {
+        shm_pending_[s->target].push_back(s);
+        ++shm_pending_count_;
+        shm_pending_bytes_ += s->payload.size();
+      } else {
+        StartSend(s);
+      }
+      busy = true;
     }
 
-    CollectActive();
+    if (FlushShared() > 0) {
+      busy = true;
+    }
+
+    if (CollectActive() > 0) {
+      busy = true;
+    }
+
+    if (busy) {
+      idle_rounds_ = 0;
+      boost::mutex::scoped_lock sl(arrival_lock_);
+      ++events_;
+      arrival_.notify_all();
+    } else {
+      Backoff();
+    }
 
     PERIODIC(10., { DumpProfile(); });
   }
 }
 
+// Pops the next request from src and keeps its ready bit in step.
+NetworkThread::Buffer* NetworkThread::pop_request(int src, int type) {
+  Buffer* s;
+  read_lock_[type].lock();
+  if (!PopReady(&requests[type][src], &s, &ready_[type][src / 64], 1ULL << (src % 64))) {
+    s = NULL;
+  }
+  read_lock_[type].unlock();
+  return s;
+}
+
+void NetworkThread::read_message(Buffer* s, int src, int type, Message* data) {
+  if (type == MTYPE_PUT_REQUEST) {
+    // the send time is the sender's clock, comparable with ours only on
+    // the same host
+    if (same_host_[src]) {
+      double us = (Now() - ((Header*)s->data())->sent) * 1e6;
+      int b = 0;
+      while (b < kLatencyBuckets - 1 && us >= (1LL << b)) {
+        ++b;
+      }
+      __sync_fetch_and_add(&put_latency_[b], 1);
+    }
+
+    int64_t read = __sync_add_and_fetch(&unreturned_[src], (int64_t)s->size());
+    if (read >= FLAGS_put_window / 4) {
+      PutCredit credit;
+      credit.set_bytes(__sync_lock_test_and_set(&unreturned_[src], 0));
+      if (credit.bytes() > 0) {
+        Send(src, MTYPE_PUT_CREDIT, credit);
+      }
+    }
+  }
+
+  if (data) {
+    data->ParseFromArray(s->data() + sizeof(Header), s->size() - sizeof(Header));
+  }
+  ReleaseBuffer(s);
+}
+
 bool NetworkThread::check_request_queue(int src, int type, Message* data) {
   CHECK_LT(src, kMaxHosts);
   CHECK_LT(type, kMaxMethods);
 
-  Queue& q = requests[type][src];
- // if(q.size()%10==0 && q.size()!=0) VLOG(1)<<"REQUEST QUEUE SIZE for type "<< type << " src " << src << " is " << q.size();
-  if (!q.empty()) {
-    boost::recursive_mutex::scoped_lock sl(q_lock[type]);
-    if (q.empty())
-      return false;
+  if (!(ready_[type][src / 64] & (1ULL << (src % 64)))) {
+    return false;
+  }
+  Buffer* s = pop_request(src, type);
+  if (s == NULL) {
+    return false;
+  }
+  read_message(s, src, type, data);
+  return true;
+}
 
-    const string& s = q.front();
-    if (data) {
-      data->ParseFromArray(s.data() + sizeof(Header), s.size() - sizeof(Header));
+bool NetworkThread::has_request(int type) const {
+  for (int w = 0; w < kReadyWords; ++w) {
+    if (ready_[type][w] != 0) {
+      return true;
     }
-
-    q.pop_front();
-    return true;
   }
   return false;
 }
 
-bool NetworkThread::check_reply_queue(int src, int type, Message* data) {
-  CHECK_LT(src, kMaxHosts);
-  CHECK_LT(type, kMaxMethods);
+int64_t NetworkThread::events() {
+  boost::mutex::scoped_lock sl(arrival_lock_);
+  return events_;
+}
+
+void NetworkThread::WaitForEvent(int64_t seen, double timeout) {
+  boost::mutex::scoped_lock sl(arrival_lock_);
+  if (events_ == seen) {
+    arrival_.timed_wait(sl, boost::posix_time::microseconds((int64_t)(timeout * 1e6)));
+  }
+}
+
+void NetworkThread::NetworkStats(Stats* out) {
+  boost::mutex::scoped_lock sl(stats_lock_);
+  out->Merge(stats_);
+}
+
+void NetworkThread::LatencyStats(Stats* out) {
+  int64_t total = 0;
+  for (int i = 0; i < kLatencyBuckets; ++i) {
+    total += put_latency_[i];
+  }
+  if (total == 0) {
+    return;
+  }
 
-  Queue& q = replies[type][src];
-  if(q.size()%10==0 && q.size()!=0) VLOG(1)<<"REPLY QUEUE SIZE for type "<< type << " src " << src << " is " << q.size();
-  if (!q.empty()) {
-    boost::recursive_mutex::scoped_lock sl(q_lock[type]);
-    if (q.empty())
-      return false;
+  // bucket b holds latencies below 2^b us; report each bucket and the bucket
+  // bounds that the median and the 99th percentile fall under
+  int64_t seen = 0;
+  bool p50 = false;
+  for (int i = 0; i < kLatencyBuckets; ++i) {
+    if (put_latency_[i] == 0) {
+      continue;
+    }
+    (*out)[StringPrintf("put_latency_us.under_%lld", 1LL << i)] += put_latency_[i];
+    seen += put_latency_[i];
+    if (!p50 && seen * 2 >= total) {
+      (*out)["put_latency_us.p50_under"] = 1LL << i;
+      p50 = true;
+    }
+    if (seen * 100 >= total * 99) {
+      (*out)["put_latency_us.p99_under"] = 1LL << i;
+      break;
+    }
+  }
+}
 
-    const string& s = q.front();
-    if (data) {
-      data->ParseFromArray(s.data() + sizeof(Header), s.size() - sizeof(Header));
+bool NetworkThread::HasCredit(int dst) const {
+  return in_flight_[dst] < FLAGS_put_window;
+}
+
+void NetworkThread::CreditStats(Stats* out) {
+  (*out)["put_window"] = FLAGS_put_window;
+  for (int i = 0; i < world_->Get_size(); ++i) {
+    if (in_flight_peak_[i] == 0) {
+      continue;
     }
+    (*out)[StringPrintf("put_in_flight.%d", i)] = in_flight_[i];
+    (*out)[StringPrintf("put_in_flight_peak.%d", i)] = in_flight_peak_[i];
+  }
+}
+
+bool NetworkThread::WaitForRequest(int type, double timeout) {
+  CHECK_LT(type, kMaxMethods);
 
-    q.pop_front();
-    return true;
+  boost::mutex::scoped_lock sl(arrival_lock_);
+  if (!has_request(type)) {
+    arrival_.timed_wait(sl, boost::posix_time::microseconds((int64_t)(timeout * 1e6)));
   }
-  return false;
+  return has_request(type);
+}
+
+bool NetworkThread::check_reply_queue(int src, int type, Message* data) {
+  CHECK_LT(src, kMaxHosts);
+  CHECK_LT(type, kMaxMethods);
+
+  Buffer* s;
+  read_lock_[type].lock();
+  bool found = replies[type][src].pop(&s);
+  read_lock_[type].unlock();
+  if (!found) {
+    return false;
+  }
+  read_message(s, src, type, data);
+  return true;
 }
 
   // Blocking read for the given source and message type.
 void NetworkThread::Read(int desired_src, int type, Message* data, int *source) {
   Timer t;
-  while (!TryRead(desired_src, type, data, source)) {
-    Sleep(FLAGS_sleep_time);
+  while (true) {
+    int64_t seen = events();
+    if (TryRead(desired_src, type, data, source)) {
+      break;
+    }
+    WaitForEvent(seen, FLAGS_sleep_time);
   }
-  stats["network_time"] += t.elapsed();
+  add_stat("network_time", t.elapsed());
 }
 
 bool NetworkThread::TryRead(int src, int type, Message* data, int *source) {
   if (src == MPI::ANY_SOURCE) {
-    for (int i = 0; i < world_->Get_size(); ++i) {
-      if (TryRead(i, type, data, source)) {
-        return true;
+    for (int w = 0; w < kReadyWords; ++w) {
+      uint64_t bits = ready_[type][w];
+      while (bits != 0) {
+        int i = w * 64 + __builtin_ctzll(bits);
+        bits &= bits - 1;
+        if (TryRead(i, type, data, source)) {
+          return true;
+        }
       }
     }
   } else {
@@ -281,8 +893,12 @@ bool NetworkThread::TryRead(int src, int type, Message* data, int *source) {
 void NetworkThread::Call(int dst, int method, const Message &msg, Message *reply) {
   Send(dst, method, msg);
   Timer t;
-  while (!check_reply_queue(dst, method, reply)) {
-    Sleep(FLAGS_sleep_time);
+  while (true) {
+    int64_t seen = events();
+    if (check_reply_queue(dst, method, reply)) {
+      break;
+    }
+    WaitForEvent(seen, FLAGS_sleep_time);
   }
 }
 
@@ -291,9 +907,17 @@ void NetworkThread::Send(RPCRequest *req) {
   boost::recursive_mutex::scoped_lock sl(send_lock);
 //    LOG(INFO) << "Sending... " << MP(req->target, req->rpc_type);
   //LOG(INFO) << "Sending... from " << id() << " to " << req->target << " type: " << req->rpc_type << " size: " << req->payload.size();
-  stats["bytes_sent"] += req->payload.size();
-  stats[StringPrintf("sends.%s", MessageTypes_Name((MessageTypes)(req->rpc_type)).c_str())] += 1;
+  add_stat("bytes_sent", req->payload.size());
+  add_stat(StringPrintf("sends.%s", MessageTypes_Name((MessageTypes)(req->rpc_type)).c_str()), 1);
   pending_sends_.push_back(req);
+
+  if (req->rpc_type == MTYPE_PUT_REQUEST) {
+    int64_t n = __sync_add_and_fetch(&in_flight_[req->target], (int64_t)req->payload.size());
+    in_flight_peak_[req->target] = max(in_flight_peak_[req->target], n);
+  }
+
+  boost::mutex::scoped_lock wl(wake_lock_);
+  wake_.notify_one();
 }
 
 int NetworkThread::Send(int dst, int method, const Message &msg) {
@@ -312,26 +936,37 @@ void NetworkThread::DSend(int dst, int method, const Message &msg) {
 	boost::recursive_mutex::scoped_lock sl(send_lock);
   RPCRequest *r = new RPCRequest(dst, method, msg);
 
-  stats["bytes_sent"] += r->payload.size();
-  stats[StringPrintf("sends.%s", MessageTypes_Name((MessageTypes)(r->rpc_type)).c_str())] += 1;
+  add_stat("bytes_sent", r->payload.size());
+  add_stat(StringPrintf("sends.%s", MessageTypes_Name((MessageTypes)(r->rpc_type)).c_str()), 1);
 
   r->start_time = Now();
   r->mpi_req = world_->Isend(
       r->payload.data(), r->payload.size(), MPI::BYTE, r->target, r->rpc_type);
-  active_sends_.insert(r);
+  active_sends_.push_back(r);
 }
 
 void NetworkThread::Shutdown() {
   if (running) {
     Flush();
+    // The network thread polls MPI without pause while it has work, so it
+    // must be stopped before MPI is finalized.
     running = false;
+    {
+      boost::mutex::scoped_lock wl(wake_lock_);
+      wake_.notify_one();
+    }
+    t_->join();
     MPI_Finalize();
   }
 }
 
 void NetworkThread::Flush() {
-  while (active()) {
-    Sleep(FLAGS_sleep_time);
+  while (true) {
+    int64_t seen = events();
+    if (!active()) {
+      break;
+    }
+    WaitForEvent(seen, FLAGS_sleep_time);
   }
 }
 
@@ -347,14 +982,68 @@ void NetworkThread::SyncBroadcast(int method, const Message& msg) {
   WaitForSync(method, world_->Get_size() - 1);
 }
 
+void NetworkThread::TreeBroadcast(int method, const Message& msg) {
+  if (!UseTree()) {
+    Broadcast(method, msg);
+    return;
+  }
+
+  vector<int> children;
+  TreeChildren(id(), &children);
+
+  Header h;
+  h.tree = true;
+  for (int i = 0; i < children.size(); ++i) {
+    Send(new RPCRequest(children[i], method, msg, h));
+  }
+}
+
+void NetworkThread::SyncTreeBroadcast(int method, const Message& msg) {
+  if (!UseTree()) {
+    SyncBroadcast(method, msg);
+    return;
+  }
+
+  vector<int> children;
+  TreeChildren(id(), &children);
+  TreeBroadcast(method, msg);
+  WaitForSync(method, children.size());
+}
+
+bool NetworkThread::UseTree() const {
+  return FLAGS_tree_min_workers > 0 && size() - 1 >= FLAGS_tree_min_workers;
+}
+
+// Without the tree every worker is a child of the master.
+int NetworkThread::tree_fanout() const {
+  return UseTree() ? FLAGS_tree_fanout : size();
+}
+
+int NetworkThread::TreeParent(int rank) const {
+  return (rank - 1) / tree_fanout();
+}
+
+void NetworkThread::TreeChildren(int rank, vector<int>* children) const {
+  int fanout = tree_fanout();
+  CHECK_GT(fanout, 0);
+  children->clear();
+  int64_t first = (int64_t)rank * fanout + 1;
+  for (int64_t c = first; c < first + fanout && c < size(); ++c) {
+    children->push_back(c);
+  }
+}
+
 void NetworkThread::WaitForSync(int method, int count) {
   EmptyMessage empty;
   while (count > 0) {
+    int64_t seen = events();
     for (int i = 0; i < world_->Get_size(); ++i) {
       if (check_reply_queue(i, method, NULL))
         --count;
     }
-    Sleep(FLAGS_sleep_time);
+    if (count > 0) {
+      WaitForEvent(seen, FLAGS_sleep_time);
+    }
   }
 }
 
@@ -4,6 +4,8 @@
 #include "util/common.h"
 #include "util/file.h"
 #include "util/common.pb.h"
+#include "util/shm-ring.h"
+#include "util/mpsc-queue.h"
 
 #include <boost/thread.hpp>
 #include <boost/function.hpp>
@@ -35,6 +37,31 @@ public:
   void Read(int desired_src, int type, Message* data, int *source=NULL);
   bool TryRead(int desired_src, int type, Message* data, int *source=NULL);
 
+  // Block until a request of the given type is queued, another message
+  // arrives or timeout seconds pass.  Returns true if such a request is queued.
+  bool WaitForRequest(int type, double timeout);
+
+  // Count of network events (messages received, sends completed) so far, and
+  // a wait until it moves past 'seen' or timeout seconds pass.  Take the count
+  // before checking a queue so that a message arriving in between still wakes
+  // the wait.
+  int64_t events();
+  void WaitForEvent(int64_t seen, double timeout);
+
+  // Adds the message and byte counts of this thread to 'out'.
+  void NetworkStats(Stats* out);
+
+  // Adds the send-to-read latency histogram of put requests to 'out'.  Only
+  // puts from ranks on this host are counted: the send time is taken on the
+  // sender's clock, so across hosts it would measure clock skew.
+  void LatencyStats(Stats* out);
+
+  // False while dst has not yet read --put_window bytes of the put requests
+  // sent to it; callers should hold back further puts to dst until then.
+  bool HasCredit(int dst) const;
+  // Adds the put flow-control state to 'out'.
+  void CreditStats(Stats* out);
+
   // Enqueue the given request for transmission.
   void Send(RPCRequest *req);
   int Send(int dst, int method, const Message &msg);
@@ -45,6 +72,22 @@ public:
   void SyncBroadcast(int method, const Message& msg);
   void WaitForSync(int method, int count);
 
+  // Like Broadcast and SyncBroadcast, but the message goes down a
+  // --tree_fanout-ary tree of ranks rooted at this one: each worker passes it
+  // on to its children and replies once it and its whole subtree have
+  // handled it.  Only for messages workers handle in a registered callback.
+  // Without UseTree() they are Broadcast and SyncBroadcast.
+  void TreeBroadcast(int method, const Message& msg);
+  void SyncTreeBroadcast(int method, const Message& msg);
+
+  // True with --tree_min_workers workers or more.
+  bool UseTree() const;
+
+  // The tree above, over all ranks with the master (rank 0) at the root; a
+  // single level, the master and every worker, without UseTree().
+  int TreeParent(int rank) const;
+  void TreeChildren(int rank, vector<int>* children) const;
+
   // Invoke 'method' on the destination, and wait for a reply.
   void Call(int dst, int method, const Message &msg, Message *reply);
 
@@ -57,8 +100,6 @@ public:
   static NetworkThread *Get();
   static void Init();
 
-  Stats stats;
-
 #ifndef SWIG
   // Register the given function with the RPC thread.  The function will be invoked
   // from within the network thread whenever a message of the given type is received.
@@ -84,30 +125,117 @@ public:
 private:
   static const int kMaxHosts = 512;
   static const int kMaxMethods = 64;
+  // Bounds on the receive buffers kept for reuse.
+  static const int kMaxPooledBuffers = 256;
+  static const int kMaxPooledBufferSize = 4 << 20;
+
+  static const int kReadyWords = kMaxHosts / 64;
 
-  typedef deque<string> Queue;
+  // Queued messages are receive buffers taken from buffer_pool_; they go back
+  // to the pool once the reader has parsed them.  The network thread is the
+  // only producer; readers of one type take read_lock_[type] to pop.
+  struct Buffer : public string, public MPSCNode {};
+  typedef MPSCQueue<Buffer> Queue;
 
   bool running;
 
   CallbackInfo* callbacks_[kMaxMethods];
 
+  // For a tree broadcast being handled here: the rank it came from, and the
+  // replies from children plus our own callback still outstanding.
+  int tree_parent_[kMaxMethods];
+  int tree_pending_[kMaxMethods];
+
   vector<RPCRequest*> pending_sends_;
-  unordered_set<RPCRequest*> active_sends_;
+  vector<RPCRequest*> active_sends_;
+  // CollectActive scratch for MPI_Testsome.
+  vector<MPI_Request> active_reqs_;
+  vector<int> completed_;
 
   Queue requests[kMaxMethods][kMaxHosts];
   Queue replies[kMaxMethods][kMaxHosts];
+  SpinLock read_lock_[kMaxMethods];
+  // Bit src of ready_[type] is set while requests[type][src] is not empty,
+  // so reads from any source visit only the sources with requests queued.
+  uint64_t ready_[kMaxMethods][kReadyWords];
+
+  vector<Buffer*> buffer_pool_;
+  boost::mutex pool_lock_;
+
+  // Same-host transport for put requests.  shm_in_[p] is the ring peer p
+  // writes to us through and shm_out_[p] the one we write to p through, both
+  // NULL for peers on other hosts.  Put requests for p wait in
+  // shm_pending_[p], in order, while shm_out_[p] is full.
+  vector<ShmRing*> shm_in_;
+  vector<ShmRing*> shm_out_;
+  vector<deque<RPCRequest*> > shm_pending_;
+  int shm_pending_count_;
+  int64_t shm_pending_bytes_;
+
+  // "received.<type>" stat names, built once instead of per message.
+  string received_stat_[kMaxMethods];
+
+  // Written by the network thread and by senders, read by NetworkStats.
+  Stats stats_;
+  boost::mutex stats_lock_;
+  void add_stat(const string& name, double v) {
+    boost::mutex::scoped_lock sl(stats_lock_);
+    stats_[name] += v;
+  }
 
   MPI::Comm *world_;
   mutable boost::recursive_mutex send_lock;
-  mutable boost::recursive_mutex q_lock[kMaxHosts];
+
+  // Signalled by the network thread on every event; events_ counts them.
+  boost::mutex arrival_lock_;
+  boost::condition_variable arrival_;
+  int64_t events_;
+
+  // Signalled by Send so that an idle network thread starts it at once.
+  boost::mutex wake_lock_;
+  boost::condition_variable wake_;
+
+  // Idle loops of the network thread since it last had work; it backs off
+  // from yielding to sleeping up to FLAGS_sleep_time as this grows.
+  int idle_rounds_;
+
+  // Send-to-read latency of put requests from same-host ranks, in
+  // power-of-two microsecond buckets; same_host_[p] is true for those.
+  static const int kLatencyBuckets = 32;
+  int64_t put_latency_[kLatencyBuckets];
+  vector<bool> same_host_;
+
+  // Flow control of put requests.  in_flight_[p] counts the bytes sent to p
+  // that p has not read yet; p returns them in MTYPE_PUT_CREDIT messages
+  // once it has read a quarter window, and unreturned_[p] counts the bytes
+  // read from p but not returned yet.
+  int64_t in_flight_[kMaxHosts];
+  int64_t in_flight_peak_[kMaxHosts];
+  int64_t unreturned_[kMaxHosts];
   mutable boost::thread *t_;
   int id_;
 
   bool check_reply_queue(int src, int type, Message *data);
   bool check_request_queue(int src, int type, Message* data);
-
-  void InvokeCallback(CallbackInfo *ci, RPCInfo rpc);
-  void CollectActive();
+  Buffer* pop_request(int src, int type);
+  void read_message(Buffer* s, int src, int type, Message* data);
+
+  Buffer* AcquireBuffer();
+  void ReleaseBuffer(Buffer* buffer);
+  bool has_request(int type) const;
+
+  void InvokeCallback(CallbackInfo *ci, RPCInfo rpc, bool tree);
+  void Reply(CallbackInfo *ci, const RPCInfo& rpc, bool tree);
+  void ForwardTree(int parent, int tag, const string& data);
+  int tree_fanout() const;
+  void TreeDone(int tag);
+  void Deliver(int source, int tag, Buffer* data);
+  void InitSharedMemory();
+  int FlushShared();
+  int PollShared();
+  void StartSend(RPCRequest* r);
+  int CollectActive();
+  void Backoff();
   void Run();
 
   NetworkThread();
@@ -0,0 +1,112 @@
+#ifndef UTIL_SHM_RING_H
+#define UTIL_SHM_RING_H
+
+#include "util/common.h"
+
+namespace dsm {
+
+// A single-producer, single-consumer ring of tagged messages that lives in
+// memory shared between two processes.  The producer only moves head, the
+// consumer only moves tail; each frame is an 8-byte {length, tag} header
+// followed by the payload padded to 8 bytes.
+class ShmRing {
+public:
+  static size_t bytes_for(size_t capacity) {
+    return sizeof(ShmRing) + capacity;
+  }
+
+  // Called by the owner of the memory before any other process maps it.
+  void init(size_t capacity) {
+    CHECK_EQ(capacity % kAlign, 0);
+    head_ = 0;
+    tail_ = 0;
+    capacity_ = capacity;
+    __sync_synchronize();
+  }
+
+  // Bytes a message of len bytes takes in the ring.
+  static size_t frame_size(size_t len) {
+    return sizeof(Frame) + (len + kAlign - 1) / kAlign * kAlign;
+  }
+
+  size_t capacity() const { return capacity_; }
+
+  // Producer side; false if the ring has no room for the message now.
+  bool write(int tag, const char* data, size_t len) {
+    uint64_t head = head_;
+    uint64_t tail = tail_;
+    __sync_synchronize();
+    size_t need = frame_size(len);
+    if (need > capacity_ - (head - tail)) {
+      return false;
+    }
+
+    Frame f = { (uint32_t)len, (uint32_t)tag };
+    copy_in(head, (const char*)&f, sizeof(f));
+    copy_in(head + sizeof(f), data, len);
+
+    __sync_synchronize();
+    head_ = head + need;
+    return true;
+  }
+
+  // Consumer side; false if the ring is empty.
+  bool read(int* tag, string* out) {
+    uint64_t tail = tail_;
+    uint64_t head = head_;
+    __sync_synchronize();
+    if (head == tail) {
+      return false;
+    }
+
+    Frame f;
+    copy_out(tail, (char*)&f, sizeof(f));
+    out->resize(f.len);
+    copy_out(tail + sizeof(f), out->empty() ? NULL : &(*out)[0], f.len);
+    *tag = f.tag;
+
+    __sync_synchronize();
+    tail_ = tail + frame_size(f.len);
+    return true;
+  }
+
+  bool empty() const {
+    return head_ == tail_;
+  }
+
+private:
+  static const size_t kAlign = 8;
+
+  struct Frame {
+    uint32_t len;
+    uint32_t tag;
+  };
+
+  void copy_in(uint64_t pos, const char* src, size_t len) {
+    size_t at = pos % capacity_;
+    size_t first = std::min(len, capacity_ - at);
+    memcpy(data_ + at, src, first);
+    memcpy(data_, src + first, len - first);
+  }
+
+  void copy_out(uint64_t pos, char* dst, size_t len) {
+    size_t at = pos % capacity_;
+    size_t first = std::min(len, capacity_ - at);
+    memcpy(dst, data_ + at, first);
+    memcpy(dst + first, data_, len - first);
+  }
+
+  // head_ and tail_ sit on their own cache lines so the two sides do not
+  // invalidate each other's line on every message.
+  volatile uint64_t head_;
+  char pad0_[64 - sizeof(uint64_t)];
+  volatile uint64_t tail_;
+  char pad1_[64 - sizeof(uint64_t)];
+  uint64_t capacity_;
+  char pad2_[64 - sizeof(uint64_t)];
+  char data_[0];
+};
+
+}
+
+#endif // UTIL_SHM_RING_H
@@ -75,6 +75,35 @@ static void StringPieceTestSplit() {
 }
 REGISTER_TEST(StringPieceSplit, StringPieceTestSplit());
 
+static void StringPieceTestConsumeInt() {
+  int v;
+  StringPiece p = "12\t-3 x4  5";
+  CHECK(ConsumeInt(&p, &v));
+  CHECK_EQ(v, 12);
+  CHECK(ConsumeInt(&p, &v));
+  CHECK_EQ(v, -3);
+  CHECK(ConsumeInt(&p, &v));
+  CHECK_EQ(v, 4);
+  CHECK(ConsumeInt(&p, &v));
+  CHECK_EQ(v, 5);
+  CHECK(!ConsumeInt(&p, &v));
+  CHECK_EQ(p.len, 0);
+
+  // no separator after the last number
+  StringPiece q = "7";
+  CHECK(ConsumeInt(&q, &v));
+  CHECK_EQ(v, 7);
+  CHECK_EQ(q.len, 0);
+
+  // no digits: nothing, a lone '-' and bytes above 0x7f
+  StringPiece e = "";
+  CHECK(!ConsumeInt(&e, &v));
+  StringPiece r = "- \xe9\xff-";
+  CHECK(!ConsumeInt(&r, &v));
+  CHECK_EQ(r.len, 0);
+}
+REGISTER_TEST(StringPieceConsumeInt, StringPieceTestConsumeInt());
+
 string StringPrintf(StringPiece fmt, ...) {
   va_list l;
   va_start(l, fmt.AsString().c_str());
@@ -7,6 +7,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdarg.h>
+#include <ctype.h>
 
 namespace dsm {
 
@@ -48,6 +49,29 @@ static const char* strnstr(const char* haystack, const char* needle, int len) {
   }
   return NULL;
 }
+
+// Parses the next decimal integer in s in place and moves s past it,
+// skipping whatever separates it from the previous one; false once s holds
+// no more digits.
+template <class T>
+static bool ConsumeInt(StringPiece* s, T* v) {
+  const char* p = s->data;
+  const char* end = p + s->len;
+  while (p < end && !isdigit((unsigned char) *p) && !(*p == '-' && p + 1 < end && isdigit((unsigned char) p[1]))) { ++p; }
+  if (p == end) {
+    s->data = end;
+    s->len = 0;
+    return false;
+  }
+  bool neg = *p == '-';
+  if (neg) { ++p; }
+  T n = 0;
+  for (; p < end && isdigit((unsigned char) *p); ++p) { n = n * 10 + (*p - '0'); }
+  *v = neg ? -n : n;
+  s->len -= p - s->data;
+  s->data = p;
+  return true;
+}
 //用空格连接字符串
 template <class Iterator>
 string JoinString(Iterator start, Iterator end, string delim=" ") {
@@ -39,6 +39,8 @@ namespace dsm {
         running_ = true;
         iterator_id_ = 0;
 
+        network_->TreeChildren(network_->id(), &tree_children_);
+
         // HACKHACKHACK - register ourselves with any existing tables
         TableRegistry::Map &t = TableRegistry::Get()->tables();
         for (TableRegistry::Map::iterator i = t.begin(); i != t.end(); ++i) {
@@ -108,9 +110,13 @@ namespace dsm {
         while (running_) {
             Timer idle;
 
-            while (!network_->TryRead(config_.master_id(), MTYPE_RUN_KERNEL, &kreq)) {
+            while (true) {
+                int64_t seen = network_->events();
+                if (network_->TryRead(config_.master_id(), MTYPE_RUN_KERNEL, &kreq)) {
+                    break;
+                }
                 CheckNetwork();
-                Sleep(FLAGS_sleep_time);
+                network_->WaitForEvent(seen, FLAGS_sleep_time);
 
                 if (!running_) {
                     return;
@@ -306,16 +312,60 @@ namespace dsm {
         network_->Send(config_.master_id(), MTYPE_CHECKPOINT_DONE, req);
     }
 
+    // Takes in the reports our children have sent up.  A newer report of a
+    // worker replaces the one we hold.
+    void Worker::CollectTermchecks() {
+        boost::recursive_mutex::scoped_lock sl(state_lock_);
+
+        TermcheckDeltas resp;
+        for (int c = 0; c < tree_children_.size(); ++c) {
+            while (network_->TryRead(tree_children_[c], MTYPE_TERMCHECK_DONE, &resp)) {
+                for (int j = 0; j < resp.partial_size(); ++j) {
+                    const TermcheckDelta& p = resp.partial(j);
+                    int i = 0;
+                    while (i < termchecks_.partial_size() && termchecks_.partial(i).worker() != p.worker()) {
+                        ++i;
+                    }
+                    if (i == termchecks_.partial_size()) {
+                        termchecks_.add_partial()->CopyFrom(p);
+                    } else {
+                        termchecks_.mutable_partial(i)->CopyFrom(p);
+                    }
+                }
+            }
+        }
+        ForwardTermchecks();
+    }
+
+    // Sends what came in since the last time up in one message, without
+    // waiting for the workers that have not reported again.
+    void Worker::ForwardTermchecks() {
+        if (termchecks_.partial_size() == 0) {
+            return;
+        }
+        network_->Send(network_->TreeParent(network_->id()), MTYPE_TERMCHECK_DONE, termchecks_);
+        termchecks_.Clear();
+    }
+
     void Worker::SendTermcheck(int snapshot, long updates, double current) {
         boost::recursive_mutex::scoped_lock sl(state_lock_);
 
-        TermcheckDelta req;
-        req.set_index(snapshot);
-        req.set_delta(current);
-        req.set_updates(updates);
-        network_->Send(config_.master_id(), MTYPE_TERMCHECK_DONE, req);
+        TermcheckDelta* req = NULL;
+        for (int i = 0; i < termchecks_.partial_size() && req == NULL; ++i) {
+            if (termchecks_.partial(i).worker() == id()) {
+                req = termchecks_.mutable_partial(i);
+            }
+        }
+        if (req == NULL) {
+            req = termchecks_.add_partial();
+        }
+        req->set_index(snapshot);
+        req->set_delta(current);
+        req->set_updates(updates);
+        req->set_worker(id());
+        CollectTermchecks();
 
-        VLOG(1) << "termination condition of subpass " << snapshot << " worker " << network_->id() << " sent to master... with total current " << StringPrintf("%.05f", current);
+        VLOG(1) << "termination condition of subpass " << snapshot << " worker " << network_->id() << " reported... with total current " << StringPrintf("%.05f", current);
         ;
     }
 
@@ -340,7 +390,11 @@ namespace dsm {
     void Worker::HandlePutRequest() {
         boost::recursive_mutex::scoped_lock sl(state_lock_);
 
-        KVPairData put;
+        if (!tree_children_.empty()) {
+            CollectTermchecks();
+        }
+
+        KVPairData& put = put_;
         while (network_->TryRead(MPI::ANY_SOURCE, MTYPE_PUT_REQUEST, &put)) {
             if (put.marker() != -1) {
                 UpdateEpoch(put.source(), put.marker());
@@ -352,18 +406,22 @@ namespace dsm {
             MutableGlobalTable *t = TableRegistry::Get()->mutable_table(put.table());
             t->ApplyUpdates(put);
 
-            // Record messages from our peer channel up until they checkpointed.
-            if (active_checkpoint_ == CP_MASTER_CONTROLLED ||
-                    (active_checkpoint_ == CP_ROLLING && put.epoch() < epoch_)) {
-                if (checkpoint_tables_.find(t->id()) != checkpoint_tables_.end()) {
-                    Checkpointable *ct = dynamic_cast<Checkpointable*> (t);
-                    ct->write_delta(put);
+            for (int i = -1; i < put.bundled_size(); ++i) {
+                const KVPairData& part = i < 0 ? put : put.bundled(i);
+
+                // Record messages from our peer channel up until they checkpointed.
+                if (active_checkpoint_ == CP_MASTER_CONTROLLED ||
+                        (active_checkpoint_ == CP_ROLLING && part.epoch() < epoch_)) {
+                    if (checkpoint_tables_.find(t->id()) != checkpoint_tables_.end()) {
+                        Checkpointable *ct = dynamic_cast<Checkpointable*> (t);
+                        ct->write_delta(part);
+                    }
                 }
-            }
 
-            if (put.done() && t->tainted(put.shard())) {
-                VLOG(1) << "Clearing taint on: " << MP(put.table(), put.shard());
-                t->get_partition_info(put.shard())->tainted = false;
+                if (part.done() && t->tainted(part.shard())) {
+                    VLOG(1) << "Clearing taint on: " << MP(part.table(), part.shard());
+                    t->get_partition_info(part.shard())->tainted = false;
+                }
             }
         }
     }
@@ -474,12 +532,22 @@ namespace dsm {
         for (TableRegistry::Map::iterator i = tmap.begin(); i != tmap.end(); ++i) {
             MutableGlobalTable* t = dynamic_cast<MutableGlobalTable*> (i->second);
             if (t) {
-                t->SendUpdates();
+                t->SendReadyUpdates();
                 t->TermCheck();
             }
         }
     }
 
+    bool Worker::WaitForUpdates(double timeout) {
+        Timer idle;
+        bool arrived = network_->WaitForRequest(MTYPE_PUT_REQUEST, timeout);
+        stats_["idle_wait_time"] += idle.elapsed();
+        stats_["idle_waits"] += 1;
+
+        HandlePutRequest();
+        return arrived;
+    }
+
     void Worker::HandleApply(const EmptyMessage& req, EmptyMessage *resp, const RPCInfo& rpc) {
         HandlePutRequest();
     }
@@ -540,7 +608,19 @@ namespace dsm {
         Worker w(conf);
         w.Run();
         Stats s = w.get_stats();
-        s.Merge(NetworkThread::Get()->stats);
+        NetworkThread::Get()->NetworkStats(&s);
+        TableRegistry::Map& tables = TableRegistry::Get()->tables();
+        for (TableRegistry::Map::iterator i = tables.begin(); i != tables.end(); ++i) {
+            MutableGlobalTable* t = dynamic_cast<MutableGlobalTable*> (i->second);
+            if (t) {
+                t->TableStats(&s);
+            }
+        }
+        NetworkThread::Get()->LatencyStats(&s);
+        NetworkThread::Get()->CreditStats(&s);
+        if (s["update_entries_sent"] > 0) {
+            s["update_bytes_per_entry"] = s["update_bytes_sent"] / s["update_entries_sent"];
+        }
         VLOG(1) << "Worker stats: \n" << s.ToString(StringPrintf("[W%d]", conf.worker_id()));
         exit(0);
     }
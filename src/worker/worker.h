@@ -51,6 +51,7 @@ namespace dsm {
         void HandleApply(const EmptyMessage& req, EmptyMessage *resp, const RPCInfo& rpc);
 
         void FlushUpdates();
+        bool WaitForUpdates(double timeout);
 
         // Enable or disable triggers
         void HandleEnableTrigger(const EnableTrigger& req, EmptyMessage* resp, const RPCInfo& rpc);
@@ -77,6 +78,8 @@ namespace dsm {
         void StartCheckpoint(int epoch, CheckpointType type);
         void FinishCheckpoint();
         void SendTermcheck(int index, long updates, double current);
+        void CollectTermchecks();
+        void ForwardTermchecks();
         void Restore(int epoch);
         void UpdateEpoch(int peer, int peer_epoch);
 
@@ -101,6 +104,13 @@ namespace dsm {
         NetworkThread *network_;
         unordered_set<GlobalTable*> dirty_tables_;
 
+        // Termcheck reports travel up the tree of NetworkThread::TreeParent.
+        // termchecks_ holds the latest report of each worker in our subtree
+        // that has not gone up yet; whatever is there goes up together each
+        // time we report or collect our children's reports.
+        vector<int> tree_children_;
+        TermcheckDeltas termchecks_;
+
         uint32_t iterator_id_;
         unordered_map<uint32_t, TableIterator*> iterators_;
 
@@ -128,6 +138,10 @@ namespace dsm {
         map<KernelId, DSMKernel*> kernels_;
 
         Stats stats_;
+
+        //the last put request read; reused so parsing one keeps the buffers of
+        //the previous one
+        KVPairData put_;
     };
 
 }